@@ -1,222 +1,2660 @@
+#define _GNU_SOURCE
 #include <emmintrin.h>
 #include <immintrin.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
 
-// hashing functions
-#include "lookup3.c"
+// Hash tables start with this many slots, small enough to stay in L1, and double whenever they become 7/8 full
+#define HASHTABLE_INITIAL_SIZE (1 << 9)
+// Slots whose tags are compared at once, the width of an SSE2 register
+#define GROUP_SIZE 16
+// Tag of a slot that has never been used, the tags of used slots have the high bit clear
+#define TAG_EMPTY 0x80
+// Bytes of a name stored inline in its hash table slot, the rest is only compared for longer names
+#define KEY_SIZE 16
+// Names are copied into arenas allocated in blocks of this many bytes
+#define ARENA_BLOCK_SIZE (1 << 16)
+// Largest measurement in tenths, the smallest is its negation
+#define MAX_MEASURE 999
+// Measurements after which a slot's narrow sum is flushed to its wide counters. Measurements are within +-999 so
+// this many of them always fit in the 32 bit sum.
+#define FLUSH_COUNT (1 << 21)
 
-#define HASHTABLE_SIZE (1 << 12)
-#define HASH_SEED_1 0xb00b1350
-#define HASH_SEED_2 0xcafebeef
+// Readable bytes guaranteed after the end of the input, enough for one load of the widest vector kernel
+#define INPUT_PADDING 64
+
+// Input that can't be mapped is read into buffers of this many bytes, which have this much room in front of them
+// for the start of a line cut off by the previous buffer. Input lines can't be longer than that.
+#define STREAM_BUFFER_SIZE (1 << 20)
+#define STREAM_HEADROOM 4096
+// Buffers to have at least when reading through io_uring, which is also how many reads can be in flight
+#define URING_MIN_BUFFERS 32
+
+// Threads claim the file in chunks of roughly this many bytes rather than one fixed slice each
+#define CHUNK_SIZE (1 << 20)
+// Smallest chunk when chunks are mapped one at a time to keep memory use under a limit
+#define MIN_WINDOW_SIZE (1 << 16)
+
+// Default number of slots of the table threads share with --engine=shared. It can't grow, this is enough for the
+// 10,000 different names the input may have to stay at a low load factor.
+#define SHARED_TABLE_SIZE (1 << 16)
+#define SLOT_EMPTY 0
+#define SLOT_CLAIMED 1
+#define SLOT_READY 2
+
+// Size of a transparent huge page, and the alignment that lets the kernel back a range with them
+#define HUGE_PAGE_SIZE (1UL << 21)
 
 struct stringslice {
   char *str;
   unsigned len;
 };
 
-struct cityline {
-  struct stringslice str;
-  int measure;
-};
+struct citydata {
+  struct stringslice str;
+  int max;
+  int min;
+  long sum;
+  unsigned long count;
+};
+
+// The part of a city that is touched for every measurement, two of them fit in a cache line. Names of up to KEY_SIZE
+// bytes are stored inline so a single vector compare finds them, sum and count are narrow and get flushed to the
+// cold part every FLUSH_COUNT measurements.
+struct cityhot {
+  char key[KEY_SIZE] __attribute__((aligned(16)));
+  int sum;
+  unsigned count;
+  short max;
+  short min;
+  unsigned len;
+};
+_Static_assert(sizeof(struct cityhot) == 32, "hot city data should be half a cache line");
+
+// The part of a city that is only needed for long names and at the end: where its name is and its wide counters
+struct citycold {
+  char *str;
+  long sum;
+  unsigned long count;
+};
+
+// Memory where a table keeps copies of its names, so they don't point into input that may go away before the end
+struct arenablock {
+  struct arenablock *next;
+  char data[];
+};
+
+struct arena {
+  struct arenablock *blocks;
+  char *next;
+  char *end;
+};
+
+// A slot of the table all threads share with --engine=shared. A thread claims an empty slot for a name by moving its
+// state from SLOT_EMPTY to SLOT_CLAIMED, fills in the name and publishes it as SLOT_READY; anyone probing past a
+// claimed slot waits for that, which happens at most once per name. After that statistics are updated with atomics.
+// Slots take a cache line each so that updates to one city don't slow down its neighbours.
+struct sharedslot {
+  _Atomic unsigned state;
+  unsigned len;
+  unsigned long hash;
+  char *str;
+  _Atomic int max;
+  _Atomic int min;
+  _Atomic long sum;
+  _Atomic unsigned long count;
+} __attribute__((aligned(64)));
+
+// Linear probing table with a fixed number of slots
+struct sharedtable {
+  struct sharedslot *slots;
+  unsigned long mask;
+};
+
+// An open addressing hash table of cities in the style of SwissTable. Next to the cities there is an array with a
+// 7 bit tag from the hash of every slot; a lookup compares the tags of a whole group of slots with one vector
+// instruction and only looks at the cities whose tag matches, so it mostly touches one line of tags and one city.
+// The hot and cold parts of every city live in two parallel arrays.
+struct result {
+  uint8_t *tags;
+  struct cityhot *hot;
+  struct citycold *cold;
+  unsigned long mask; // number of slots - 1
+  unsigned long size; // occupied slots
+  struct arena names;
+  bool huge_pages; // back the slot arrays with transparent huge pages
+  struct sharedtable *shared; // if not NULL cities go there, and this table only keeps their names
+};
+
+typedef unsigned (*index_block_fn)(const char *block, unsigned size,
+                                   uint32_t *offsets);
+
+// A range of chunk indices, packed so that both ends can be updated with a single CAS: the low 32 bits are the next
+// chunk the owner will take, the high 32 bits are one past the last chunk (where thieves take from).
+struct chunkqueue {
+  _Atomic unsigned long range;
+} __attribute__((aligned(64)));
+
+// Where the threads get their input from: chunks of a mapped file, or buffers from a stream if stream isn't NULL
+struct workqueue {
+  index_block_fn index_block;
+  struct stream *stream;
+  char *data;
+  unsigned long size;
+  unsigned long chunk_size;
+  bool windowed; // data is NULL and every chunk is mapped from fd on its own
+  unsigned long base;      // offset in the file of the first window, which covers size bytes from there
+  unsigned long file_size; // windows can look past size up to here for the line crossing their end
+  int fd;
+  unsigned num_queues;
+  struct chunkqueue *queues;
+  int *nodes; // NUMA node of the thread that owns each queue
+  unsigned prefetch_distance; // chunks the prefetch thread keeps ready past every queue's head, 0 if there is none
+  bool huge_pages;
+  struct sharedtable *shared; // table for all threads, NULL if each has its own
+  unsigned streams;           // of lines each thread parses at the same time, see parse_chunk
+};
+
+// Once parsing is done threads merge their tables pairwise, in rounds separated by a barrier
+struct reduction {
+  pthread_barrier_t barrier;
+  unsigned num_threads;
+  struct threadinfo *threads;
+};
+
+struct threadinfo {
+  pthread_t thread;
+  unsigned id;
+  int cpu; // the thread is pinned to this CPU, or -1 if it isn't pinned
+  struct workqueue *work;
+  struct reduction *reduction;
+  struct result result;
+};
+
+// Check whether the first len bytes of two names are equal, 16 at a time.
+// ASSUMPTIONS: 16 bytes are readable past the end of both, which holds for names in the input thanks to their ';',
+// temperature and INPUT_PADDING
+__attribute__((pure))
+static inline bool name_equals(const char *a, const char *b, unsigned len) {
+  for (unsigned i = 0; i < len; i += 16) {
+    __m128i aa = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i bb = _mm_loadu_si128((const __m128i *)(b + i));
+    unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(aa, bb)) & 0xffff;
+    // Differences past the end of the names are just the bytes that follow them
+    if (diff && i + __builtin_ctz(diff) < len) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Order two names by their bytes as unsigned values, like memcmp, which for UTF-8 is the order of the code points.
+// The first differing byte is found 16 bytes at a time. Same assumptions as name_equals.
+__attribute__((pure))
+static inline int name_cmp(const struct stringslice *a,
+                           const struct stringslice *b) {
+  unsigned len = a->len < b->len ? a->len : b->len;
+  for (unsigned i = 0; i < len; i += 16) {
+    __m128i aa = _mm_loadu_si128((const __m128i *)(a->str + i));
+    __m128i bb = _mm_loadu_si128((const __m128i *)(b->str + i));
+    unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(aa, bb)) & 0xffff;
+    if (diff) {
+      unsigned j = i + __builtin_ctz(diff);
+      if (j >= len) {
+        break;
+      }
+      return (unsigned char)a->str[j] - (unsigned char)b->str[j];
+    }
+  }
+  return (a->len > b->len) - (a->len < b->len);
+}
+
+// Load a name as an inline key: its first 16 bytes, with everything past the end of shorter names zeroed.
+// ASSUMPTIONS: the 16 bytes at str are readable, which holds for any name in the input followed by its ';',
+// temperature and INPUT_PADDING
+__attribute__((pure))
+static inline __m128i load_key(const char *str, unsigned len) {
+  __m128i bytes = _mm_loadu_si128((const __m128i *)str);
+  __m128i index = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i limit = _mm_set1_epi8(len < KEY_SIZE ? len : KEY_SIZE);
+  return _mm_and_si128(bytes, _mm_cmpgt_epi8(limit, index));
+}
+
+// Hash a name from its first 16 bytes, its last 8, a word from the middle of names longer than 24 and its length.
+// The first two words come out of the key that was just loaded for the lookup and the others are plain loads from
+// bytes the parser just scanned, so all of them are in L1. Names up to 24 bytes are covered entirely; longer ones
+// that only differ outside those words collide, which costs a longer probe but never a wrong result.
+__attribute__((pure))
+static inline unsigned long hash_key(__m128i key, const char *str,
+                                     unsigned len) {
+  unsigned long first = _mm_cvtsi128_si64(key);
+  unsigned long second = _mm_cvtsi128_si64(_mm_unpackhi_epi64(key, key));
+  unsigned long last;
+  unsigned long middle;
+  memcpy(&last, str + (len > 8 ? len - 8 : 0), sizeof(last));
+  memcpy(&middle, str + (len > 24 ? len / 2 - 4 : 0), sizeof(middle));
+  last = len > 8 ? last : 0;
+  middle = len > 24 ? middle : 0;
+
+  unsigned long h = (first ^ second * 0xc2b2ae3d27d4eb4f ^
+                     (last << 29 | last >> 35) ^ middle * 0x165667b19e3779f9 ^
+                     len) *
+                    0x9e3779b97f4a7c15;
+  return h ^ h >> 32;
+}
+
+// Copy a name into an arena, followed by 16 readable bytes so it can be loaded and compared like names in the input
+static char *arena_copy(struct arena *arena, const char *str, unsigned len) {
+  unsigned long needed = len + 16;
+  if ((unsigned long)(arena->end - arena->next) < needed) {
+    unsigned long size = needed > ARENA_BLOCK_SIZE ? needed : ARENA_BLOCK_SIZE;
+    struct arenablock *block = malloc(sizeof(*block) + size);
+    if (block == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->next = block->data;
+    arena->end = block->data + size;
+  }
+  char *copy = arena->next;
+  memcpy(copy, str, len);
+  arena->next += needed;
+  return copy;
+}
+
+static void free_arena(struct arena *arena) {
+  while (arena->blocks != NULL) {
+    struct arenablock *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+}
+
+// The three slot arrays share a single allocation, hot records first so they stay cache line aligned. With huge
+// pages it is rounded to whole huge pages and advised before anything touches it, so a table of any size takes as
+// few TLB entries as it can.
+static void init_table(struct result *result, unsigned long slots) {
+  unsigned long size =
+      slots * (sizeof(*result->hot) + sizeof(*result->cold) + 1);
+  unsigned long alignment = result->huge_pages ? HUGE_PAGE_SIZE : 64;
+  size = (size + alignment - 1) & ~(alignment - 1);
+  result->hot = aligned_alloc(alignment, size);
+  if (result->hot == NULL) {
+    perror("aligned_alloc");
+    exit(EXIT_FAILURE);
+  }
+  if (result->huge_pages) {
+    madvise(result->hot, size, MADV_HUGEPAGE);
+  }
+  result->cold = (struct citycold *)(result->hot + slots);
+  result->tags = (uint8_t *)(result->cold + slots);
+  memset(result->tags, TAG_EMPTY, slots);
+  result->mask = slots - 1;
+  result->size = 0;
+}
+
+static void free_table(struct result *result) {
+  free(result->hot);
+}
+
+static void init_result(struct result *result, unsigned long slots,
+                        bool huge_pages) {
+  result->huge_pages = huge_pages;
+  result->shared = NULL;
+  init_table(result, slots);
+  memset(&result->names, 0, sizeof(result->names));
+}
+
+static void free_result(struct result *result) {
+  free_table(result);
+  free_arena(&result->names);
+}
+
+// Empty a table for reuse, keeping its slots
+static void clear_result(struct result *result) {
+  memset(result->tags, TAG_EMPTY, result->mask + 1);
+  result->size = 0;
+  free_arena(&result->names);
+  memset(&result->names, 0, sizeof(result->names));
+}
+
+__attribute__((pure))
+static inline bool slot_used(const struct result *result, unsigned long slot) {
+  return !(result->tags[slot] & TAG_EMPTY);
+}
+
+static void grow_result(struct result *result);
+
+// Find the slot of a name, adding it with empty statistics if it isn't in the table yet. The low bits of the hash
+// choose the first group to probe, the top 7 bits are the tag. Groups are probed one after the other until the name
+// is found or a group has an empty slot, which means the name isn't in the table.
+static inline unsigned long find_slot(struct result *result, char *str,
+                                      unsigned len, __m128i key,
+                                      unsigned long hash) {
+  uint8_t tag = hash >> 57;
+  __m128i target = _mm_set1_epi8(tag);
+
+  for (unsigned long group = hash & result->mask & ~(GROUP_SIZE - 1UL);;
+       group = (group + GROUP_SIZE) & result->mask) {
+    __m128i tags = _mm_load_si128((__m128i *)(result->tags + group));
+    unsigned matches = _mm_movemask_epi8(_mm_cmpeq_epi8(tags, target));
+    for (; matches; matches &= matches - 1) {
+      unsigned long slot = group + __builtin_ctz(matches);
+      const struct cityhot *hot = &result->hot[slot];
+      __m128i current_key = _mm_load_si128((const __m128i *)hot->key);
+      if (hot->len == len &&
+          _mm_movemask_epi8(_mm_cmpeq_epi8(key, current_key)) == 0xffff &&
+          (len <= KEY_SIZE ||
+           name_equals(str + KEY_SIZE, result->cold[slot].str + KEY_SIZE,
+                       len - KEY_SIZE))) {
+        return slot;
+      }
+    }
+
+    unsigned empty = _mm_movemask_epi8(tags);
+    if (empty) {
+      unsigned long slot = group + __builtin_ctz(empty);
+      struct cityhot *hot = &result->hot[slot];
+      result->tags[slot] = tag;
+      _mm_store_si128((__m128i *)hot->key, key);
+      hot->len = len;
+      hot->max = INT16_MIN;
+      hot->min = INT16_MAX;
+      hot->sum = 0;
+      hot->count = 0;
+      result->cold[slot].str = arena_copy(&result->names, str, len);
+      result->cold[slot].sum = 0;
+      result->cold[slot].count = 0;
+      if (++result->size > (result->mask + 1) / 8 * 7) {
+        grow_result(result);
+        return find_slot(result, str, len, key, hash);
+      }
+      return slot;
+    }
+  }
+}
+
+// Move the running sum and count of a slot to its wide counters
+static inline void flush_slot(struct result *result, unsigned long slot) {
+  result->cold[slot].sum += result->hot[slot].sum;
+  result->cold[slot].count += result->hot[slot].count;
+  result->hot[slot].sum = 0;
+  result->hot[slot].count = 0;
+}
+
+// Add one measurement of a city, whose key and hash are already known
+static inline void record_measure(struct result *result, char *str,
+                                  unsigned len, __m128i key,
+                                  unsigned long hash, int measure) {
+  unsigned long slot = find_slot(result, str, len, key, hash);
+  struct cityhot *hot = &result->hot[slot];
+  hot->max = measure > hot->max ? measure : hot->max;
+  hot->min = measure < hot->min ? measure : hot->min;
+  hot->sum += measure;
+  if (++hot->count == FLUSH_COUNT) {
+    flush_slot(result, slot);
+  }
+}
+
+// Add one measurement of a city to the shared table. Names are copied to the arena of whoever adds them.
+static inline void record_shared(struct result *result, char *str,
+                                 unsigned len, unsigned long hash,
+                                 int measure) {
+  struct sharedtable *table = result->shared;
+
+  struct sharedslot *slot;
+  for (unsigned long i = hash & table->mask, probes = 0;;
+       i = (i + 1) & table->mask) {
+    slot = &table->slots[i];
+    unsigned state = atomic_load_explicit(&slot->state, memory_order_acquire);
+    if (state == SLOT_EMPTY &&
+        atomic_compare_exchange_strong_explicit(&slot->state, &state,
+                                                SLOT_CLAIMED,
+                                                memory_order_acquire,
+                                                memory_order_acquire)) {
+      slot->hash = hash;
+      slot->len = len;
+      slot->str = arena_copy(&result->names, str, len);
+      atomic_store_explicit(&slot->max, INT_MIN, memory_order_relaxed);
+      atomic_store_explicit(&slot->min, INT_MAX, memory_order_relaxed);
+      atomic_store_explicit(&slot->state, SLOT_READY, memory_order_release);
+      break;
+    }
+    while (state == SLOT_CLAIMED) {
+      _mm_pause();
+      state = atomic_load_explicit(&slot->state, memory_order_acquire);
+    }
+    if (slot->hash == hash && slot->len == len &&
+        name_equals(str, slot->str, len)) {
+      break;
+    }
+    if (++probes > table->mask) {
+      fprintf(stderr, "Shared table full, raise --table-size\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Extremes stop changing early on, so they are only written when they do
+  int max = atomic_load_explicit(&slot->max, memory_order_relaxed);
+  while (measure > max &&
+         !atomic_compare_exchange_weak_explicit(&slot->max, &max, measure,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+  int min = atomic_load_explicit(&slot->min, memory_order_relaxed);
+  while (measure < min &&
+         !atomic_compare_exchange_weak_explicit(&slot->min, &min, measure,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+  atomic_fetch_add_explicit(&slot->sum, measure, memory_order_relaxed);
+  atomic_fetch_add_explicit(&slot->count, 1, memory_order_relaxed);
+}
+
+// Start loading the lines a lookup of a hash will look at first: its group of tags and the first city in it, or its
+// slot in the shared table
+static inline void prefetch_slot(const struct result *result,
+                                 unsigned long hash) {
+  if (result->shared != NULL) {
+    __builtin_prefetch(&result->shared->slots[hash & result->shared->mask], 1);
+    return;
+  }
+  unsigned long group = hash & result->mask & ~(GROUP_SIZE - 1UL);
+  __builtin_prefetch(result->tags + group, 0);
+  __builtin_prefetch(&result->hot[group], 1);
+}
+
+// Get the full statistics of a slot
+__attribute__((pure))
+static inline struct citydata get_city(const struct result *result,
+                                       unsigned long slot) {
+  const struct cityhot *hot = &result->hot[slot];
+  const struct citycold *cold = &result->cold[slot];
+  struct citydata city;
+  city.str.str = cold->str;
+  city.str.len = hot->len;
+  city.max = hot->max;
+  city.min = hot->min;
+  city.sum = cold->sum + hot->sum;
+  city.count = cold->count + hot->count;
+  return city;
+}
+
+// Add the statistics of a city from another table
+static inline void merge_city(struct result *result,
+                              const struct citydata *city) {
+  __m128i key = load_key(city->str.str, city->str.len);
+  unsigned long slot =
+      find_slot(result, city->str.str, city->str.len, key,
+                hash_key(key, city->str.str, city->str.len));
+  struct cityhot *hot = &result->hot[slot];
+  hot->max = city->max > hot->max ? city->max : hot->max;
+  hot->min = city->min < hot->min ? city->min : hot->min;
+  result->cold[slot].sum += city->sum;
+  result->cold[slot].count += city->count;
+}
+
+// Add every city of src to dst, and empty src. Its slots stay allocated so it can be used again.
+static void merge_result(struct result *dst, struct result *src) {
+  for (unsigned long i = 0; i <= src->mask; i++) {
+    if (slot_used(src, i)) {
+      struct citydata city = get_city(src, i);
+      merge_city(dst, &city);
+    }
+  }
+  clear_result(src);
+}
+
+// First empty slot in the probe sequence of a hash
+__attribute__((pure))
+static inline unsigned long empty_slot(const struct result *result,
+                                       unsigned long hash) {
+  for (unsigned long group = hash & result->mask & ~(GROUP_SIZE - 1UL);;
+       group = (group + GROUP_SIZE) & result->mask) {
+    __m128i tags = _mm_load_si128((__m128i *)(result->tags + group));
+    unsigned empty = _mm_movemask_epi8(tags);
+    if (empty) {
+      return group + __builtin_ctz(empty);
+    }
+  }
+}
+
+// Double the number of slots and rehash everything once the table is 7/8 full, before probes get long. Names are
+// all different and stay in the same arena, so cities just move to the first empty slot of their probe sequence.
+__attribute__((noinline))
+static void grow_result(struct result *result) {
+  struct result old = *result;
+  init_table(result, (old.mask + 1) * 2);
+  for (unsigned long i = 0; i <= old.mask; i++) {
+    if (slot_used(&old, i)) {
+      const struct cityhot *hot = &old.hot[i];
+      char *str = old.cold[i].str;
+      __m128i key = _mm_load_si128((const __m128i *)hot->key);
+      unsigned long hash = hash_key(key, str, hot->len);
+      unsigned long slot = empty_slot(result, hash);
+      result->tags[slot] = hash >> 57;
+      result->hot[slot] = *hot;
+      result->cold[slot] = old.cold[i];
+    }
+  }
+  result->size = old.size;
+  free_table(&old);
+}
+
+// Parsing happens in two stages. First a vector kernel scans a whole block and writes the offset of every ';' in it
+// to an array, then the lines are decoded from those offsets in a tight loop, without going back to searching for
+// delimiters. The end of each line comes out of the temperature decoder, so newlines are never searched for.
+
+// Bytes indexed per pass of the first stage, small enough for the block and its offsets to stay in L1
+#define INDEX_BLOCK_SIZE 4096
+// Upper bound of the offsets written for one block, flatten_bits may write up to 8 entries past the real count
+#define INDEX_CAPACITY (INDEX_BLOCK_SIZE + 8)
+// Lines parsed and hashed ahead of their table updates
+#define PROBE_BATCH 16
+// Most streams of lines a thread parses at the same time, and how many it does by default
+#define MAX_STREAMS 4
+#define DEFAULT_STREAMS 2
+
+// Results are sorted with a radix sort on name bytes: one bucket for names that end plus one per byte value.
+// Buckets smaller than the cutoff are sorted by insertion, and the sort uses every thread from PARALLEL_SORT_MIN
+// cities on.
+#define RADIX_BUCKETS 257
+#define RADIX_SORT_CUTOFF 32
+#define PARALLEL_SORT_MIN (1 << 14)
+
+// Append the position of every set bit of mask, plus base, to out[n..]. The first 8 are written unconditionally,
+// which covers most 64 byte blocks in a single go without a branch per delimiter.
+static inline unsigned flatten_bits(uint32_t *out, unsigned n, uint32_t base,
+                                    uint64_t mask) {
+  unsigned count = __builtin_popcountll(mask);
+  uint32_t *o = out + n;
+  for (int i = 0; i < 8; i++) {
+    // Keep ctz defined once mask runs out, the extra entries are garbage past count anyway
+    o[i] = base + __builtin_ctzll(mask | (1UL << 63));
+    mask &= mask - 1;
+  }
+  for (int i = 8; mask; i++) {
+    o[i] = base + __builtin_ctzll(mask);
+    mask &= mask - 1;
+  }
+  return n + count;
+}
+
+// The delimiters_* kernels below return a bitmap of the ';' bytes among the 64 bytes at str.
+// ASSUMPTIONS: the 64 bytes at str are readable, which INPUT_PADDING guarantees up to the end of the input
+
+__attribute__((pure))
+static inline uint64_t delimiters_scalar(const char *str) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i++) {
+    mask |= (uint64_t)(str[i] == ';') << i;
+  }
+  return mask;
+}
+
+__attribute__((pure))
+static inline uint64_t delimiters_sse2(const char *str) {
+  __m128i semicolon = _mm_set1_epi8(';');
+  uint64_t mask = 0;
+
+  for (int i = 0; i < 64; i += 16) {
+    __m128i chunk = _mm_loadu_si128((__m128i *)(str + i));
+    __m128i res = _mm_cmpeq_epi8(chunk, semicolon);
+    mask |= (uint64_t)(unsigned)_mm_movemask_epi8(res) << i;
+  }
+
+  return mask;
+}
+
+__attribute__((pure, target("avx2,popcnt,bmi")))
+static inline uint64_t delimiters_avx2(const char *str) {
+  __m256i semicolon = _mm256_set1_epi8(';');
+
+  __m256i lo = _mm256_loadu_si256((__m256i *)str);
+  __m256i hi = _mm256_loadu_si256((__m256i *)(str + 32));
+  __m256i res_lo = _mm256_cmpeq_epi8(lo, semicolon);
+  __m256i res_hi = _mm256_cmpeq_epi8(hi, semicolon);
+
+  return (uint64_t)(unsigned)_mm256_movemask_epi8(res_lo) |
+         (uint64_t)(unsigned)_mm256_movemask_epi8(res_hi) << 32;
+}
+
+__attribute__((pure, target("avx512f,avx512bw,popcnt,bmi")))
+static inline uint64_t delimiters_avx512(const char *str) {
+  __m512i chunk = _mm512_loadu_si512((__m512i *)str);
+  return _mm512_cmpeq_epi8_mask(chunk, _mm512_set1_epi8(';'));
+}
+
+// First stage: write the offsets of all ';' in the size bytes at block to offsets and return how many there
+// are. One copy is generated per kernel so the scan gets inlined with the right instruction set enabled.
+#define DEFINE_INDEX_BLOCK(isa, ...)                                           \
+  __VA_ARGS__ static unsigned index_block_##isa(                               \
+      const char *block, unsigned size, uint32_t *offsets) {                   \
+    unsigned n = 0;                                                            \
+    unsigned i = 0;                                                            \
+    for (; i + 64 <= size; i += 64) {                                          \
+      n = flatten_bits(offsets, n, i, delimiters_##isa(block + i));            \
+    }                                                                          \
+    if (i < size) {                                                            \
+      uint64_t mask = delimiters_##isa(block + i);                             \
+      n = flatten_bits(offsets, n, i, mask & ((1UL << (size - i)) - 1));       \
+    }                                                                          \
+    return n;                                                                  \
+  }
+
+DEFINE_INDEX_BLOCK(scalar)
+DEFINE_INDEX_BLOCK(sse2)
+DEFINE_INDEX_BLOCK(avx2, __attribute__((target("avx2,popcnt,bmi"))))
+DEFINE_INDEX_BLOCK(avx512, __attribute__((target("avx512f,avx512bw,popcnt,bmi"))))
+
+// Decode the temperature that follows a ';' in tenths of a degree, and store in *advance how many bytes there are
+// from the ';' to the start of the next line. The format is always -?\d?\d\.\d so the 8 bytes after the ';' can be
+// decoded as one little endian word without a single branch:
+//  - digits are 0x30-0x39 and have bit 4 set, while '.' (0x2e) and '-' (0x2d) don't. The lowest clear bit 4 among
+//    bytes 1 to 3 gives the position of the '.', and the one of byte 0 tells whether there is a sign.
+//  - shifting the word so the '.' always lands in byte 3 puts the digits in bytes 1, 2 and 4, where one
+//    multiplication by 100 * 2^24 + 10 * 2^16 + 1 sums them with their weights into bits 32 to 41.
+// ASSUMPTIONS: the 8 bytes after the ';' are readable, which INPUT_PADDING guarantees up to the end of the input
+static inline int decode_measure(const char *semicolon, unsigned *advance) {
+  uint64_t word;
+  memcpy(&word, semicolon + 1, sizeof(word));
+
+  unsigned dot = __builtin_ctzll(~word & 0x10101000);
+  // All ones when the first byte is '-'
+  int64_t sign = (int64_t)(~word << 59) >> 63;
+  uint64_t digits = ((word & ~(sign & 0xff)) << (28 - dot)) & 0x0f000f0f00;
+  int n = ((digits * 0x640a0001) >> 32) & 0x3ff;
+
+  // ';' + sign and integer digits + '.' + decimal + '\n'
+  *advance = (dot >> 3) + 4;
+  return (n ^ sign) - sign;
+}
+
+// Offset right after the first newline at or after pos - 1 in the size bytes at data, or size if there is none.
+// Chunks start at the line boundary found this way from their nominal start, and whoever claims a chunk computes
+// both of its ends like that, so every line belongs to exactly one chunk.
+__attribute__((pure))
+static unsigned long line_boundary(const char *data, unsigned long size,
+                                   unsigned long pos) {
+  if (pos == 0) {
+    return 0;
+  }
+  if (pos >= size) {
+    return size;
+  }
+  const char *newline = memchr(data + pos - 1, '\n', size - pos + 1);
+  return newline != NULL ? (unsigned long)(newline + 1 - data) : size;
+}
+
+// A line that has been parsed and hashed but not recorded yet
+struct pendingline {
+  char *str;
+  unsigned len;
+  int measure;
+  __m128i key;
+  unsigned long hash;
+};
+
+// One of the independent streams of lines parse_chunk goes through at the same time
+struct cursor {
+  char *block;     // block the offsets are relative to
+  char *line;      // next line to parse
+  char *end;       // end of this stream's lines
+  unsigned n;      // number of offsets
+  unsigned k;      // next offset to use
+  uint32_t offsets[INDEX_CAPACITY];
+};
+
+// Parse the next line of a cursor, indexing its next block first if it has used up the current one. Returns false
+// once the cursor has no more lines.
+static inline bool next_line(index_block_fn index_block, struct cursor *cursor,
+                             struct pendingline *p) {
+  if (cursor->k == cursor->n) {
+    // The block starts at a line, so the first name ends at the first ';' and each decoded temperature says where
+    // the next name starts. A line whose ';' didn't make it into a block is scanned again from the next one.
+    // Without a final newline the last line seems to end a little past the input
+    if (cursor->line >= cursor->end) {
+      return false;
+    }
+    unsigned long left = cursor->end - cursor->line;
+    cursor->block = cursor->line;
+    cursor->n = index_block(cursor->block,
+                            left < INDEX_BLOCK_SIZE ? left : INDEX_BLOCK_SIZE,
+                            cursor->offsets);
+    cursor->k = 0;
+    if (cursor->n == 0) {
+      // A name longer than a whole block, rare enough to just search for its ';'
+      char *semicolon = memchr(cursor->line, ';', left);
+      if (semicolon == NULL) {
+        return false;
+      }
+      cursor->offsets[0] = semicolon - cursor->block;
+      cursor->n = 1;
+    }
+  }
+  char *semicolon = cursor->block + cursor->offsets[cursor->k++];
+  unsigned advance;
+  p->str = cursor->line;
+  p->len = semicolon - cursor->line;
+  p->measure = decode_measure(semicolon, &advance);
+  p->key = load_key(p->str, p->len);
+  p->hash = hash_key(p->key, p->str, p->len);
+  cursor->line = semicolon + advance;
+  return true;
+}
+
+// Second stage: parse all lines in a block of memory that starts at a line and ends right after a newline.
+// Each line can only be found once the one before it has been parsed, so the memory is split into work->streams
+// ranges at line boundaries and lines are taken from each in turn: the dependency chains of different streams
+// don't wait for each other, and the core can work on all of them at once.
+// Lines also go in batches: all of a batch is parsed and hashed and the slots it will look at are prefetched, then
+// it is recorded. Misses on the table overlap with each other and with parsing instead of stalling every line.
+static inline void parse_chunk(const struct workqueue *work, char *start,
+                               unsigned long size, struct result *result) {
+  struct cursor cursors[MAX_STREAMS];
+  struct pendingline pending[PROBE_BATCH];
+
+  // Tiny pieces, like the ends of a stream, aren't worth splitting
+  unsigned streams = work->streams;
+  if (size < streams * INDEX_BLOCK_SIZE) {
+    streams = 1;
+  }
+  unsigned long begin = 0;
+  for (unsigned s = 0; s < streams; s++) {
+    unsigned long end = line_boundary(start, size, size * (s + 1) / streams);
+    cursors[s].line = start + begin;
+    cursors[s].end = start + end;
+    cursors[s].n = 0;
+    cursors[s].k = 0;
+    begin = end;
+  }
+
+  unsigned rounds = PROBE_BATCH / streams;
+  for (;;) {
+    unsigned batch = 0;
+    for (unsigned round = 0; round < rounds; round++) {
+      for (unsigned s = 0; s < streams; s++) {
+        if (next_line(work->index_block, &cursors[s], &pending[batch])) {
+          prefetch_slot(result, pending[batch].hash);
+          batch++;
+        }
+      }
+    }
+    if (batch == 0) {
+      break;
+    }
+    for (unsigned j = 0; j < batch; j++) {
+      struct pendingline *p = &pending[j];
+      if (result->shared != NULL) {
+        record_shared(result, p->str, p->len, p->hash, p->measure);
+      } else {
+        record_measure(result, p->str, p->len, p->key, p->hash, p->measure);
+      }
+    }
+  }
+}
+
+struct kernel {
+  const char *name;
+  const char *cpu_feature; // as understood by cpu_supports, NULL if always available
+  index_block_fn index_block;
+};
+
+// Ordered from the widest to the narrowest vectors, the first one the CPU supports is picked by default
+static const struct kernel kernels[] = {
+    {"avx512", "avx512bw", index_block_avx512},
+    {"avx2", "avx2", index_block_avx2},
+    {"sse2", NULL, index_block_sse2},
+    {"scalar", NULL, index_block_scalar},
+};
+#define NUM_KERNELS (sizeof(kernels) / sizeof(*kernels))
+
+// __builtin_cpu_supports only accepts string literals
+static bool cpu_supports(const char *feature) {
+  if (feature == NULL) {
+    return true;
+  }
+  // The vector kernels are also compiled with popcnt and bmi, which every CPU with these extensions has
+  bool base = __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi");
+  if (strcmp(feature, "avx512bw") == 0) {
+    return base && __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw");
+  }
+  if (strcmp(feature, "avx2") == 0) {
+    return base && __builtin_cpu_supports("avx2");
+  }
+  return false;
+}
+
+// Pick the named kernel, or the widest one the CPU supports if name is NULL
+static const struct kernel *select_kernel(const char *name) {
+  __builtin_cpu_init();
+  for (unsigned i = 0; i < NUM_KERNELS; i++) {
+    if (name != NULL && strcmp(name, kernels[i].name) != 0) {
+      continue;
+    }
+    if (cpu_supports(kernels[i].cpu_feature)) {
+      return &kernels[i];
+    }
+    if (name != NULL) {
+      fprintf(stderr, "Kernel %s is not supported by this CPU\n", name);
+      exit(EXIT_FAILURE);
+    }
+  }
+  fprintf(stderr, "Unknown kernel %s\n", name);
+  exit(EXIT_FAILURE);
+}
+
+// Map size bytes of the file from offset, which must be a multiple of the page size, with at least INPUT_PADDING
+// readable bytes after them so vector loads may run past the last line. Bytes past the end of the file within its
+// last page read as zero, the rest of the padding is anonymous memory. Mappings of at least a huge page start on a
+// huge page boundary, which the kernel needs before it can use huge pages for them.
+static char *map_padded(int fd, unsigned long offset, unsigned long size,
+                        unsigned long *mapped_size) {
+  unsigned long page_size = sysconf(_SC_PAGESIZE);
+  *mapped_size = (size + INPUT_PADDING + page_size - 1) & ~(page_size - 1);
+
+  unsigned long slack = size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 0;
+  char *region = mmap(NULL, *mapped_size + slack, PROT_READ,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    return region;
+  }
+  if (slack > 0) {
+    // Give back the reservation before and after the aligned part
+    char *aligned = (char *)(((unsigned long)region + slack - 1) & ~(slack - 1));
+    if (aligned > region) {
+      munmap(region, aligned - region);
+    }
+    munmap(aligned + *mapped_size, region + slack - aligned);
+    region = aligned;
+  }
+  if (size == 0) {
+    return region;
+  }
+  if (mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, offset) ==
+      MAP_FAILED) {
+    munmap(region, *mapped_size);
+    return MAP_FAILED;
+  }
+  return region;
+}
+
+// Split work->size bytes into chunks, each of the threads starts with an equal contiguous share of them
+static void init_queues(struct workqueue *work, unsigned num_threads) {
+  unsigned long num_chunks = (work->size + work->chunk_size - 1) / work->chunk_size;
+  work->num_queues = num_threads;
+  work->queues = aligned_alloc(64, sizeof(*work->queues) * num_threads);
+  if (work->queues == NULL) {
+    perror("aligned_alloc");
+    exit(EXIT_FAILURE);
+  }
+  for (unsigned i = 0; i < num_threads; i++) {
+    unsigned long head = num_chunks * i / num_threads;
+    unsigned long tail = num_chunks * (i + 1) / num_threads;
+    atomic_init(&work->queues[i].range, (tail << 32) | head);
+  }
+}
+
+// Take the next chunk from the front of our own queue
+static inline bool take_chunk(struct chunkqueue *queue, unsigned *chunk) {
+  unsigned long range = atomic_load_explicit(&queue->range, memory_order_relaxed);
+  for (;;) {
+    unsigned head = range & 0xffffffff;
+    unsigned tail = range >> 32;
+    if (head >= tail) {
+      return false;
+    }
+    unsigned long next = ((unsigned long)tail << 32) | (head + 1);
+    if (atomic_compare_exchange_weak_explicit(&queue->range, &range, next,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      *chunk = head;
+      return true;
+    }
+  }
+}
+
+// Take a chunk from the back of someone else's queue, so the victim keeps reading its range sequentially
+static inline bool steal_chunk(struct chunkqueue *queue, unsigned *chunk) {
+  unsigned long range = atomic_load_explicit(&queue->range, memory_order_relaxed);
+  for (;;) {
+    unsigned head = range & 0xffffffff;
+    unsigned tail = range >> 32;
+    if (head >= tail) {
+      return false;
+    }
+    unsigned long next = ((unsigned long)(tail - 1) << 32) | head;
+    if (atomic_compare_exchange_weak_explicit(&queue->range, &range, next,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      *chunk = tail - 1;
+      return true;
+    }
+  }
+}
+
+// Block until *word no longer holds seen, or a wake_waiters on it
+static void wait_for_change(_Atomic unsigned *word, unsigned seen) {
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void wake_waiters(_Atomic unsigned *word) {
+  atomic_fetch_add_explicit(word, 1, memory_order_release);
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Bounded lock-free multi-producer multi-consumer queue of buffers (Dmitry Vyukov's design). Every cell has a
+// sequence number that tells producers and consumers whose turn it is, so each side only contends on its own index.
+struct queuecell {
+  _Atomic unsigned long sequence;
+  struct streambuffer *buffer;
+};
+
+struct bufferqueue {
+  struct queuecell *cells;
+  unsigned long mask;
+  _Atomic unsigned long head __attribute__((aligned(64))); // next cell to push to
+  _Atomic unsigned long tail __attribute__((aligned(64))); // next cell to pop from
+  _Atomic unsigned pushed __attribute__((aligned(64)));     // futex word bumped after every push
+};
+
+// Create a queue able to hold at least capacity buffers
+static void init_queue(struct bufferqueue *queue, unsigned long capacity) {
+  unsigned long size = 1;
+  while (size < capacity) {
+    size *= 2;
+  }
+  queue->cells = malloc(sizeof(*queue->cells) * size);
+  if (queue->cells == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (unsigned long i = 0; i < size; i++) {
+    atomic_init(&queue->cells[i].sequence, i);
+  }
+  queue->mask = size - 1;
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  atomic_init(&queue->pushed, 0);
+}
+
+// Queues are sized for every buffer there is, so pushing always succeeds
+static void queue_push(struct bufferqueue *queue, struct streambuffer *buffer) {
+  unsigned long pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  struct queuecell *cell;
+  for (;;) {
+    cell = &queue->cells[pos & queue->mask];
+    unsigned long sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    long diff = (long)(sequence - pos);
+    if (diff == 0 &&
+        atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      break;
+    }
+    if (diff != 0) {
+      pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    }
+  }
+  cell->buffer = buffer;
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+  wake_waiters(&queue->pushed);
+}
+
+static bool queue_pop(struct bufferqueue *queue, struct streambuffer **buffer) {
+  unsigned long pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  struct queuecell *cell;
+  for (;;) {
+    cell = &queue->cells[pos & queue->mask];
+    unsigned long sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    long diff = (long)(sequence - (pos + 1));
+    if (diff < 0) {
+      return false;
+    }
+    if (diff == 0 &&
+        atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      break;
+    }
+    if (diff != 0) {
+      pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    }
+  }
+  *buffer = cell->buffer;
+  atomic_store_explicit(&cell->sequence, pos + queue->mask + 1,
+                        memory_order_release);
+  return true;
+}
+
+// Pop a buffer, sleeping while the queue is empty. Returns NULL once the queue is empty and *closed is set, which
+// producers only do after their last push.
+static struct streambuffer *queue_wait_pop(struct bufferqueue *queue,
+                                           _Atomic bool *closed) {
+  struct streambuffer *buffer;
+  for (;;) {
+    unsigned seen = atomic_load_explicit(&queue->pushed, memory_order_acquire);
+    if (queue_pop(queue, &buffer)) {
+      return buffer;
+    }
+    if (closed != NULL && atomic_load_explicit(closed, memory_order_acquire)) {
+      return queue_pop(queue, &buffer) ? buffer : NULL;
+    }
+    wait_for_change(&queue->pushed, seen);
+  }
+}
+
+// A buffer of input that isn't mapped from a file. Its memory has STREAM_HEADROOM bytes in front of the data where
+// the start of a line cut off by the previous buffer is copied, and at least INPUT_PADDING bytes after it.
+struct streambuffer {
+  char *memory;
+  char *start;        // first line
+  unsigned long size; // bytes up to the end of the last complete line
+};
+
+struct stream {
+  int fd;
+  unsigned num_buffers;
+  struct streambuffer *buffers;
+  struct bufferqueue full; // read and waiting to be parsed
+  struct bufferqueue free; // parsed and waiting to be filled again
+  _Atomic bool done;       // no more buffers will be pushed to full
+};
+
+static void init_stream(struct stream *stream, int fd, unsigned num_buffers) {
+  stream->fd = fd;
+  stream->num_buffers = num_buffers;
+  stream->buffers = malloc(sizeof(*stream->buffers) * num_buffers);
+  if (stream->buffers == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  init_queue(&stream->full, num_buffers);
+  init_queue(&stream->free, num_buffers);
+  atomic_init(&stream->done, false);
+  for (unsigned i = 0; i < num_buffers; i++) {
+    // The padding is rounded up to a whole STREAM_HEADROOM, as aligned_alloc needs a multiple of the alignment
+    stream->buffers[i].memory = aligned_alloc(
+        STREAM_HEADROOM, STREAM_HEADROOM + STREAM_BUFFER_SIZE + STREAM_HEADROOM);
+    if (stream->buffers[i].memory == NULL) {
+      perror("aligned_alloc");
+      exit(EXIT_FAILURE);
+    }
+    queue_push(&stream->free, &stream->buffers[i]);
+  }
+}
+
+static void free_stream(struct stream *stream) {
+  for (unsigned i = 0; i < stream->num_buffers; i++) {
+    free(stream->buffers[i].memory);
+  }
+  free(stream->buffers);
+  free(stream->full.cells);
+  free(stream->free.cells);
+}
+
+// Hand a buffer with filled bytes of data to the parsing threads, in front of the carry left by the previous one,
+// and keep whatever follows its last newline as the carry for the next one. The last buffer of the input gets a
+// newline after its last line if it had none. Returns false, with the buffer back on the free queue, if the carry
+// would be longer than STREAM_HEADROOM.
+static bool pass_buffer(struct stream *stream, struct streambuffer *buffer,
+                        unsigned long filled, bool last, char *carry,
+                        unsigned long *carry_size) {
+  char *data = buffer->memory + STREAM_HEADROOM;
+  char *start = data - *carry_size;
+  char *end = data + filled;
+  memcpy(start, carry, *carry_size);
+  if (last && end > start && end[-1] != '\n') {
+    // There is padding room for it
+    *end++ = '\n';
+  }
+  char *last_newline = memrchr(start, '\n', end - start);
+  char *lines_end = last_newline != NULL ? last_newline + 1 : start;
+
+  *carry_size = end - lines_end;
+  if (*carry_size > STREAM_HEADROOM) {
+    queue_push(&stream->free, buffer);
+    return false;
+  }
+  memcpy(carry, lines_end, *carry_size);
+
+  buffer->start = start;
+  buffer->size = lines_end - start;
+  queue_push(buffer->size > 0 ? &stream->full : &stream->free, buffer);
+  return true;
+}
+
+// Read the whole stream into buffers and hand them to the parsing threads. Returns 0 once it has all been read, the
+// errno of a failed read, or -1 for a line longer than STREAM_HEADROOM. The threads are let go in every case, with
+// whatever was read before an error.
+static int read_stream(struct stream *stream) {
+  char carry[STREAM_HEADROOM];
+  unsigned long carry_size = 0;
+  bool eof = false;
+  int error = 0;
+
+  while (!eof && error == 0) {
+    struct streambuffer *buffer = queue_wait_pop(&stream->free, NULL);
+    char *data = buffer->memory + STREAM_HEADROOM;
+
+    unsigned long filled = 0;
+    while (filled < STREAM_BUFFER_SIZE) {
+      ssize_t n = read(stream->fd, data + filled, STREAM_BUFFER_SIZE - filled);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n == -1) {
+        error = errno;
+        break;
+      }
+      if (n == 0) {
+        eof = true;
+        break;
+      }
+      filled += n;
+    }
+    if (error != 0) {
+      queue_push(&stream->free, buffer);
+    } else if (!pass_buffer(stream, buffer, filled, eof, carry, &carry_size)) {
+      error = -1;
+    }
+  }
+
+  atomic_store_explicit(&stream->done, true, memory_order_release);
+  wake_waiters(&stream->full.pushed);
+  return error;
+}
+
+// Tell what read_stream failed on. Windows report their lines that are too long through here as well.
+static void report_stream_error(int error) {
+  if (error == -1) {
+    fprintf(stderr, "Line longer than %d bytes in input\n", STREAM_HEADROOM);
+  } else {
+    fprintf(stderr, "read: %s\n", strerror(error));
+  }
+}
+
+// Just enough of io_uring, through its raw system calls, to keep reads of a file in flight
+struct uring {
+  int fd;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  unsigned long sq_ring_size;
+  void *cq_ring;
+  unsigned long cq_ring_size;
+  unsigned long sqes_size;
+  bool fixed_buffers; // the stream buffers are registered with the kernel
+};
+
+// Set up a ring with room for entries requests, returns false if the kernel won't give us one
+static bool init_uring(struct uring *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+  if (ring->fd == -1) {
+    return false;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = ring->sq_ring;
+  if (ring->sq_ring != MAP_FAILED &&
+      !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+
+  char *sq = ring->sq_ring;
+  char *cq = ring->cq_ring;
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring->fixed_buffers = false;
+  return true;
+}
+
+static void free_uring(struct uring *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+// Register the data area of every stream buffer, which spares the kernel mapping them on every read. Not being
+// allowed to (too little locked memory, for one) only costs that, reads work the same without.
+static void register_buffers(struct uring *ring, struct stream *stream) {
+  struct iovec *iovecs = malloc(sizeof(*iovecs) * stream->num_buffers);
+  if (iovecs == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (unsigned i = 0; i < stream->num_buffers; i++) {
+    iovecs[i].iov_base = stream->buffers[i].memory + STREAM_HEADROOM;
+    iovecs[i].iov_len = STREAM_BUFFER_SIZE;
+  }
+  ring->fixed_buffers = syscall(SYS_io_uring_register, ring->fd,
+                                IORING_REGISTER_BUFFERS, iovecs,
+                                stream->num_buffers) == 0;
+  free(iovecs);
+}
+
+// Queue a read of length bytes at offset into buffer, to be submitted with the next io_uring_enter
+static void queue_read(struct uring *ring, struct stream *stream,
+                       unsigned buffer, unsigned long done,
+                       unsigned long offset, unsigned length) {
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = ring->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = stream->fd;
+  sqe->off = offset + done;
+  sqe->addr =
+      (unsigned long)(stream->buffers[buffer].memory + STREAM_HEADROOM + done);
+  sqe->len = length - done;
+  sqe->buf_index = buffer;
+  sqe->user_data = buffer;
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Read a regular file of the given size through io_uring and hand the buffers to the parsing threads, in file order.
+// As many reads as there are free buffers are kept in flight, and with O_DIRECT on the descriptor they go straight
+// from the device to the buffers without the page cache. Buffers complete in any order, they are passed on in order
+// so the start of a line cut off by the previous buffer can be copied in front of the next one's data.
+static void read_stream_uring(struct stream *stream, struct uring *ring,
+                              unsigned long size) {
+  unsigned n = stream->num_buffers;
+  unsigned long num_reads = (size + STREAM_BUFFER_SIZE - 1) / STREAM_BUFFER_SIZE;
+  // Per buffer: which read it holds and how many bytes of it have arrived
+  unsigned long *read_of = malloc(sizeof(*read_of) * n);
+  unsigned long *filled = malloc(sizeof(*filled) * n);
+  // Per read still to be passed on, modulo the number of buffers: the buffer it completed in, or -1
+  int *completed = malloc(sizeof(*completed) * n);
+  if (read_of == NULL || filled == NULL || completed == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (unsigned i = 0; i < n; i++) {
+    completed[i] = -1;
+  }
+
+  char carry[STREAM_HEADROOM];
+  unsigned long carry_size = 0;
+  unsigned long next_read = 0;
+  unsigned long next_pass = 0;
+  unsigned in_flight = 0;
+  unsigned to_submit = 0;
+
+  while (next_pass < num_reads) {
+    // Start reads into every free buffer, or wait for one if there is nothing else to wait for
+    struct streambuffer *buffer;
+    while (next_read < num_reads) {
+      if (in_flight == 0) {
+        buffer = queue_wait_pop(&stream->free, NULL);
+      } else if (!queue_pop(&stream->free, &buffer)) {
+        break;
+      }
+      unsigned index = buffer - stream->buffers;
+      read_of[index] = next_read;
+      filled[index] = 0;
+      queue_read(ring, stream, index, 0, next_read * STREAM_BUFFER_SIZE,
+                 STREAM_BUFFER_SIZE);
+      next_read++;
+      to_submit++;
+      in_flight++;
+    }
+
+    long submitted = syscall(SYS_io_uring_enter, ring->fd, to_submit, 1,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted == -1 && errno != EINTR) {
+      perror("io_uring_enter");
+      exit(EXIT_FAILURE);
+    }
+    if (submitted > 0) {
+      to_submit -= submitted;
+    }
+
+    // Collect completions, reads that came up short before the end of the file are queued again for the rest
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+      unsigned index = cqe->user_data;
+      unsigned long offset = read_of[index] * STREAM_BUFFER_SIZE;
+      unsigned long expected =
+          size - offset < STREAM_BUFFER_SIZE ? size - offset : STREAM_BUFFER_SIZE;
+      in_flight--;
+      if (cqe->res < 0) {
+        fprintf(stderr, "read: %s\n", strerror(-cqe->res));
+        exit(EXIT_FAILURE);
+      }
+      if (cqe->res == 0 && filled[index] < expected) {
+        fprintf(stderr, "read: file shrank while reading it\n");
+        exit(EXIT_FAILURE);
+      }
+      filled[index] += cqe->res;
+      if (filled[index] < expected) {
+        queue_read(ring, stream, index, filled[index], offset,
+                   STREAM_BUFFER_SIZE);
+        to_submit++;
+        in_flight++;
+        continue;
+      }
+      filled[index] = expected;
+      completed[read_of[index] % n] = index;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    // Pass on the buffers that are next in file order
+    while (next_pass < num_reads && completed[next_pass % n] != -1) {
+      unsigned index = completed[next_pass % n];
+      completed[next_pass % n] = -1;
+      next_pass++;
+
+      if (!pass_buffer(stream, &stream->buffers[index], filled[index],
+                       next_pass == num_reads, carry, &carry_size)) {
+        report_stream_error(-1);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  free(read_of);
+  free(filled);
+  free(completed);
+
+  atomic_store_explicit(&stream->done, true, memory_order_release);
+  wake_waiters(&stream->full.pushed);
+}
+
+// Parse buffers from the stream until it runs dry
+static void parse_stream(struct workqueue *work, struct result *result) {
+  struct streambuffer *buffer;
+  while ((buffer = queue_wait_pop(&work->stream->full, &work->stream->done)) !=
+         NULL) {
+    parse_chunk(work, buffer->start, buffer->size, result);
+    queue_push(&work->stream->free, buffer);
+  }
+}
+
+// Map just the part of the file where the lines of the chunk at offset can be, parse them, and let go of it: the
+// mapping is removed and the page cache asked to drop what only this chunk needed, so memory use stays at about a
+// chunk per thread however big the file is. The mapping starts a byte early, to see whether a line ends right
+// before the chunk, and goes STREAM_HEADROOM bytes past its nominal end for the line that crosses it.
+static void parse_window(struct workqueue *work, unsigned long offset,
+                         struct result *result) {
+  unsigned long page_size = sysconf(_SC_PAGESIZE);
+  unsigned long nominal_end = offset + work->chunk_size;
+  if (nominal_end > work->base + work->size) {
+    nominal_end = work->base + work->size;
+  }
+  unsigned long map_start = (offset > 0 ? offset - 1 : 0) & ~(page_size - 1);
+  unsigned long map_end = nominal_end + STREAM_HEADROOM;
+  if (map_end > work->file_size) {
+    map_end = work->file_size;
+  }
+
+  unsigned long mapped_size;
+  char *window =
+      map_padded(work->fd, map_start, map_end - map_start, &mapped_size);
+  if (window == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  madvise(window, map_end - map_start, MADV_SEQUENTIAL);
+
+  unsigned long window_size = map_end - map_start;
+  unsigned long start = line_boundary(window, window_size, offset - map_start);
+  unsigned long end =
+      line_boundary(window, window_size, nominal_end - map_start);
+  if (end == window_size && map_end < work->file_size) {
+    report_stream_error(-1);
+    exit(EXIT_FAILURE);
+  }
+  parse_chunk(work, window + start, end - start, result);
+
+  if (munmap(window, mapped_size) == -1) {
+    perror("munmap");
+    exit(EXIT_FAILURE);
+  }
+  // Neighbouring chunks may still need the pages at the edges, only drop those in between
+  unsigned long drop_start = (offset + page_size - 1) & ~(page_size - 1);
+  unsigned long drop_end = nominal_end & ~(page_size - 1);
+  if (drop_end > drop_start) {
+    posix_fadvise(work->fd, drop_start, drop_end - drop_start,
+                  POSIX_FADV_DONTNEED);
+  }
+}
+
+// Parse chunks of the mapped file until there are none left to take or steal
+static void parse_mapped(struct workqueue *work, unsigned id,
+                         struct result *result) {
+  unsigned chunk;
+
+  for (;;) {
+    if (!take_chunk(&work->queues[id], &chunk)) {
+      // Our own range is done, help whoever still has work left. Threads on our own NUMA node come first, as the
+      // pages of their chunks are on it too (if they haven't been read yet, we'll be the one reading them anyway).
+      bool stolen = false;
+      for (unsigned pass = 0; pass < 2 && !stolen; pass++) {
+        for (unsigned i = 1; i < work->num_queues && !stolen; i++) {
+          unsigned victim = (id + i) % work->num_queues;
+          if ((work->nodes[victim] == work->nodes[id]) == (pass == 0)) {
+            stolen = steal_chunk(&work->queues[victim], &chunk);
+          }
+        }
+      }
+      if (!stolen) {
+        break;
+      }
+    }
+    unsigned long offset = chunk * work->chunk_size;
+    if (work->windowed) {
+      parse_window(work, work->base + offset, result);
+      continue;
+    }
+    unsigned long start = line_boundary(work->data, work->size, offset);
+    unsigned long end =
+        line_boundary(work->data, work->size, offset + work->chunk_size);
+    parse_chunk(work, work->data + start, end - start, result);
+  }
+}
+
+// Bring a chunk of the file (and the start of the next one, for the line crossing into it) into memory ahead of the
+// worker that will parse it. Mapped chunks have their page tables filled too so that worker doesn't even take a minor
+// fault; kernels older than 5.14 only get the readahead hint. Windows aren't mapped yet, so only their page cache can
+// be filled.
+static void prefetch_chunk(const struct workqueue *work, unsigned long chunk) {
+  unsigned long start = chunk * work->chunk_size;
+  unsigned long end = start + work->chunk_size + STREAM_HEADROOM;
+  if (end > work->size) {
+    end = work->size;
+  }
+  if (work->windowed) {
+    posix_fadvise(work->fd, work->base + start, end - start,
+                  POSIX_FADV_WILLNEED);
+  } else if (madvise(work->data + start, end - start, MADV_POPULATE_READ) ==
+             -1) {
+    madvise(work->data + start, end - start, MADV_WILLNEED);
+  }
+}
+
+// Thread target that keeps the prefetch_distance chunks past the head of every queue in memory, polling the heads
+// as the workers move them, until every queue is empty. Chunks taken by thieves from the tail aren't followed.
+static void *prefetch_ahead(void *arg) {
+  struct workqueue *work = arg;
+  const struct timespec pause = {.tv_sec = 0, .tv_nsec = 100000};
+
+  unsigned *next = calloc(work->num_queues, sizeof(*next));
+  if (next == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    bool remaining = false;
+    bool progress = false;
+    for (unsigned i = 0; i < work->num_queues; i++) {
+      unsigned long range =
+          atomic_load_explicit(&work->queues[i].range, memory_order_relaxed);
+      unsigned head = range & 0xffffffff;
+      unsigned tail = range >> 32;
+      if (head >= tail) {
+        continue;
+      }
+      remaining = true;
+      if (next[i] < head) {
+        next[i] = head;
+      }
+      while (next[i] < tail && next[i] - head < work->prefetch_distance) {
+        prefetch_chunk(work, next[i]++);
+        progress = true;
+      }
+    }
+    if (!remaining) {
+      break;
+    }
+    if (!progress) {
+      nanosleep(&pause, NULL);
+    }
+  }
+
+  free(next);
+  return NULL;
+}
+
+// Thread target that parses lines
+static void *parse_lines(void *arg) {
+  struct threadinfo *info = arg;
+  struct workqueue *work = info->work;
+
+  // Worked on in a local copy, as threadinfos share cache lines
+  struct result result = info->result;
+
+  // Allocated by the thread itself so the table's pages are first touched by the core that uses them, which puts them
+  // on its NUMA node. Pinned threads are created on their CPU, so that's where they stay. Threads that are used
+  // again keep the (empty) table they had.
+  if (result.hot == NULL) {
+    init_result(&result, HASHTABLE_INITIAL_SIZE, work->huge_pages);
+  }
+  result.shared = work->shared;
+
+  if (work->stream != NULL) {
+    parse_stream(work, &result);
+  } else {
+    parse_mapped(work, info->id, &result);
+  }
+  info->result = result;
+
+  // Tree reduction: in the round with a given stride, every thread whose id is a multiple of twice the stride
+  // takes in the table of the thread stride ids above it. After log2(threads) rounds thread 0 has everything.
+  // With a shared table there is nothing to merge, and the names in every table must stay where they are.
+  struct reduction *reduction = info->reduction;
+  for (unsigned stride = 1;
+       work->shared == NULL && stride < reduction->num_threads; stride *= 2) {
+    pthread_barrier_wait(&reduction->barrier);
+    if (info->id % (2 * stride) == 0 &&
+        info->id + stride < reduction->num_threads) {
+      merge_result(&info->result,
+                   &reduction->threads[info->id + stride].result);
+    }
+  }
+
+  return NULL;
+}
+
+// Parse a size in bytes with an optional K, M or G suffix, returns 0 if it isn't one
+__attribute__((pure))
+static unsigned long parse_size(const char *str) {
+  char *end;
+  unsigned long size = strtoul(str, &end, 10);
+  if (end == str) {
+    return 0;
+  }
+  switch (*end) {
+  case 'G':
+  case 'g':
+    size <<= 10;
+    // fall through
+  case 'M':
+  case 'm':
+    size <<= 10;
+    // fall through
+  case 'K':
+  case 'k':
+    size <<= 10;
+    end++;
+    break;
+  }
+  return *end == '\0' ? size : 0;
+}
+
+// Sort the few cities left at the bottom of the radix sort by comparing names
+static void insertion_sort(struct citydata *cities, unsigned long n) {
+  for (unsigned long i = 1; i < n; i++) {
+    struct citydata city = cities[i];
+    unsigned long j = i;
+    for (; j > 0 && name_cmp(&city.str, &cities[j - 1].str) < 0; j--) {
+      cities[j] = cities[j - 1];
+    }
+    cities[j] = city;
+  }
+}
+
+// Bucket of a city in the radix pass at depth: 0 for names no longer than that, so they come first, or 1 + their
+// byte at depth
+__attribute__((pure))
+static inline unsigned radix_bucket(const struct citydata *city,
+                                    unsigned depth) {
+  return depth < city->str.len ? 1 + (unsigned char)city->str.str[depth] : 0;
+}
+
+// Reorder cities by their bucket at depth, through scratch, and leave the first city of every bucket in starts
+static void radix_pass(struct citydata *cities, struct citydata *scratch,
+                       unsigned long n, unsigned depth,
+                       unsigned long starts[RADIX_BUCKETS + 1]) {
+  unsigned long next[RADIX_BUCKETS];
+  memset(starts, 0, sizeof(*starts) * (RADIX_BUCKETS + 1));
+  for (unsigned long i = 0; i < n; i++) {
+    starts[radix_bucket(&cities[i], depth) + 1]++;
+  }
+  for (unsigned b = 0; b < RADIX_BUCKETS; b++) {
+    starts[b + 1] += starts[b];
+    next[b] = starts[b];
+  }
+  for (unsigned long i = 0; i < n; i++) {
+    scratch[next[radix_bucket(&cities[i], depth)]++] = cities[i];
+  }
+  memcpy(cities, scratch, sizeof(*cities) * n);
+}
+
+// Most significant byte first radix sort of cities that all share their first depth bytes. Names are all
+// different, so the bucket of names that end at depth has one city at most and is sorted already.
+static void radix_sort(struct citydata *cities, struct citydata *scratch,
+                       unsigned long n, unsigned depth) {
+  if (n < RADIX_SORT_CUTOFF) {
+    insertion_sort(cities, n);
+    return;
+  }
+  unsigned long starts[RADIX_BUCKETS + 1];
+  radix_pass(cities, scratch, n, depth, starts);
+  for (unsigned b = 1; b < RADIX_BUCKETS; b++) {
+    radix_sort(cities + starts[b], scratch + starts[b],
+               starts[b + 1] - starts[b], depth + 1);
+  }
+}
+
+// The buckets of the first radix pass, which threads take one at a time and sort on their own
+struct sortjob {
+  struct citydata *cities;
+  struct citydata *scratch;
+  unsigned long starts[RADIX_BUCKETS + 1];
+  _Atomic unsigned next;
+};
+
+// Thread target that sorts buckets of a sortjob until there are none left
+static void *sort_buckets(void *arg) {
+  struct sortjob *job = arg;
+  unsigned b;
+  while ((b = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed)) <
+         RADIX_BUCKETS) {
+    radix_sort(job->cities + job->starts[b], job->scratch + job->starts[b],
+               job->starts[b + 1] - job->starts[b], 1);
+  }
+  return NULL;
+}
+
+// Sort cities by name. Lots of them are split by their first byte and the buckets sorted by num_threads threads.
+static void sort_cities(struct citydata *cities, unsigned long n,
+                        unsigned num_threads) {
+  struct citydata *scratch = malloc(sizeof(*scratch) * (n + 1));
+  if (scratch == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  if (n < PARALLEL_SORT_MIN || num_threads < 2) {
+    radix_sort(cities, scratch, n, 0);
+  } else {
+    struct sortjob job;
+    pthread_t *helpers = malloc(sizeof(*helpers) * (num_threads - 1));
+    if (helpers == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    job.cities = cities;
+    job.scratch = scratch;
+    radix_pass(cities, scratch, n, 0, job.starts);
+    atomic_init(&job.next, 1);
+    for (unsigned i = 0; i < num_threads - 1; i++) {
+      pthread_create(&helpers[i], NULL, sort_buckets, &job);
+    }
+    sort_buckets(&job);
+    for (unsigned i = 0; i < num_threads - 1; i++) {
+      pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+  }
+  free(scratch);
+}
 
-struct citydata {
-  struct stringslice str;
-  int max;
-  int min;
-  long sum;
-  unsigned long count;
-};
+// Output formats
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 1
+#define FORMAT_JSON 2
+#define FORMAT_PARTIAL 3
 
-struct result {
-  struct citydata *cities;
+// Partial results, to be merged with others later, are a header and then a record per city followed by its name. All
+// fields are in the byte order of the machine, which for everything this runs on is little endian. Readers reject
+// versions they don't know.
+#define PARTIAL_MAGIC "1BRCPART"
+#define PARTIAL_VERSION 1
+
+struct partialheader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t count; // of records
 };
 
-struct threadinfo {
-  pthread_t thread;
-  char *start;
-  unsigned long size;
-  struct result result;
+struct partialrecord {
+  uint32_t len; // of the name after the record
+  int32_t min;
+  int32_t max;
+  uint32_t reserved;
+  int64_t sum;
+  uint64_t count;
 };
+_Static_assert(sizeof(struct partialheader) == 24, "partial header layout");
+_Static_assert(sizeof(struct partialrecord) == 32, "partial record layout");
 
+// Mean of a city in tenths of a degree, rounded half up like Java's Math.round: floor(sum / count + 1/2), which is
+// floor((2 * sum + count) / (2 * count)) in integers
 __attribute__((pure))
-static int stringslice_cmp(const void *a, const void *b) {
-  const struct stringslice *aa = a;
-  const struct stringslice *bb = b;
+static inline long mean_tenths(const struct citydata *city) {
+  long numerator = 2 * city->sum + (long)city->count;
+  long denominator = 2 * (long)city->count;
+  long mean = numerator / denominator;
+  return mean - (numerator % denominator != 0 && numerator < 0);
+}
 
-  for (unsigned i = 0;; i++) {
-    bool as = aa->len <= i;
-    bool bs = bb->len <= i;
-    if (as && bs) {
-      return 0;
-    }
-    if (as) {
-      return -1;
+// Write a temperature given in tenths of a degree, as in -12.3 or 0.0
+static inline char *format_tenths(char *out, long tenths) {
+  char digits[24];
+  unsigned n = 0;
+  if (tenths < 0) {
+    *out++ = '-';
+    tenths = -tenths;
+  }
+  digits[n++] = '0' + tenths % 10;
+  digits[n++] = '.';
+  tenths /= 10;
+  do {
+    digits[n++] = '0' + tenths % 10;
+    tenths /= 10;
+  } while (tenths > 0);
+  while (n > 0) {
+    *out++ = digits[--n];
+  }
+  return out;
+}
+
+// Write min, mean and max of a city separated by sep
+static inline char *format_stats(char *out, const struct citydata *city,
+                                 char sep) {
+  out = format_tenths(out, city->min);
+  *out++ = sep;
+  out = format_tenths(out, mean_tenths(city));
+  *out++ = sep;
+  return format_tenths(out, city->max);
+}
+
+// The format of the challenge: {name=min/mean/max, ...}
+static char *format_text(char *out, const struct citydata *cities,
+                         unsigned long num_cities) {
+  *out++ = '{';
+  for (unsigned long i = 0; i < num_cities; i++) {
+    if (i > 0) {
+      *out++ = ',';
+      *out++ = ' ';
     }
-    if (bs) {
-      return 1;
+    memcpy(out, cities[i].str.str, cities[i].str.len);
+    out += cities[i].str.len;
+    *out++ = '=';
+    out = format_stats(out, &cities[i], '/');
+  }
+  *out++ = '}';
+  *out++ = '\n';
+  return out;
+}
+
+// A header and a line per city, names are quoted when they have a comma or a quote in them
+static char *format_csv(char *out, const struct citydata *cities,
+                        unsigned long num_cities) {
+  static const char header[] = "station,min,mean,max\n";
+  memcpy(out, header, sizeof(header) - 1);
+  out += sizeof(header) - 1;
+  for (unsigned long i = 0; i < num_cities; i++) {
+    const struct stringslice *name = &cities[i].str;
+    if (memchr(name->str, ',', name->len) != NULL ||
+        memchr(name->str, '"', name->len) != NULL) {
+      *out++ = '"';
+      for (unsigned j = 0; j < name->len; j++) {
+        if (name->str[j] == '"') {
+          *out++ = '"';
+        }
+        *out++ = name->str[j];
+      }
+      *out++ = '"';
+    } else {
+      memcpy(out, name->str, name->len);
+      out += name->len;
     }
-    char ac = aa->str[i];
-    char bc = bb->str[i];
-    if (ac < bc) {
-      return -1;
+    *out++ = ',';
+    out = format_stats(out, &cities[i], ',');
+    *out++ = '\n';
+  }
+  return out;
+}
+
+// An object with an object of min, mean and max for each city
+static char *format_json(char *out, const struct citydata *cities,
+                         unsigned long num_cities) {
+  static const char hex[] = "0123456789abcdef";
+  *out++ = '{';
+  for (unsigned long i = 0; i < num_cities; i++) {
+    const struct stringslice *name = &cities[i].str;
+    if (i > 0) {
+      *out++ = ',';
     }
-    if (ac > bc) {
-      return 1;
+    *out++ = '"';
+    for (unsigned j = 0; j < name->len; j++) {
+      unsigned char c = name->str[j];
+      if (c == '"' || c == '\\') {
+        *out++ = '\\';
+        *out++ = c;
+      } else if (c < 0x20) {
+        memcpy(out, "\\u00", 4);
+        out[4] = hex[c >> 4];
+        out[5] = hex[c & 0xf];
+        out += 6;
+      } else {
+        *out++ = c;
+      }
     }
+    memcpy(out, "\":{\"min\":", 9);
+    out = format_tenths(out + 9, cities[i].min);
+    memcpy(out, ",\"mean\":", 8);
+    out = format_tenths(out + 8, mean_tenths(&cities[i]));
+    memcpy(out, ",\"max\":", 7);
+    out = format_tenths(out + 7, cities[i].max);
+    *out++ = '}';
   }
+  *out++ = '}';
+  *out++ = '\n';
+  return out;
 }
 
-static inline bool insert_name_hashed(struct result *result,
-                                      struct citydata city, unsigned hash) {
-  struct citydata current_city = result->cities[hash];
-  if (current_city.count == 0) {
-    current_city = city;
-  } else {
-    if (stringslice_cmp(&city.str, &current_city.str) != 0) {
-      return false;
+// Binary partial results
+static char *format_partial(char *out, const struct citydata *cities,
+                            unsigned long num_cities) {
+  struct partialheader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PARTIAL_MAGIC, sizeof(header.magic));
+  header.version = PARTIAL_VERSION;
+  header.count = num_cities;
+  memcpy(out, &header, sizeof(header));
+  out += sizeof(header);
+  for (unsigned long i = 0; i < num_cities; i++) {
+    struct partialrecord record;
+    memset(&record, 0, sizeof(record));
+    record.len = cities[i].str.len;
+    record.min = cities[i].min;
+    record.max = cities[i].max;
+    record.sum = cities[i].sum;
+    record.count = cities[i].count;
+    memcpy(out, &record, sizeof(record));
+    memcpy(out + sizeof(record), cities[i].str.str, record.len);
+    out += sizeof(record) + record.len;
+  }
+  return out;
+}
+
+// Add every city of size bytes of partial results to a table, with the same merge the threads' tables go through.
+// name says where they come from in errors.
+// ASSUMPTIONS: INPUT_PADDING bytes are readable after the data, as names are looked up in place
+static void merge_partial_data(const char *name, const char *data,
+                               unsigned long size, struct result *result) {
+  struct partialheader header;
+  if (size < sizeof(header)) {
+    goto malformed;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, PARTIAL_MAGIC, sizeof(header.magic)) != 0) {
+    goto malformed;
+  }
+  if (header.version != PARTIAL_VERSION) {
+    fprintf(stderr, "%s: unsupported partial results version %u\n", name,
+            header.version);
+    exit(EXIT_FAILURE);
+  }
+
+  unsigned long pos = sizeof(header);
+  for (uint64_t i = 0; i < header.count; i++) {
+    struct partialrecord record;
+    if (size - pos < sizeof(record)) {
+      goto malformed;
     }
-    if (city.max > current_city.max) {
-      current_city.max = city.max;
+    memcpy(&record, data + pos, sizeof(record));
+    pos += sizeof(record);
+    if (size - pos < record.len || record.len == 0 || record.count == 0) {
+      goto malformed;
     }
-    if (city.min < current_city.min) {
-      current_city.min = city.min;
+    // The table keeps min and max in 16 bits, and the sum has to be one count measurements between them can add up to
+    if (record.min < -MAX_MEASURE || record.min > record.max ||
+        record.max > MAX_MEASURE ||
+        record.sum < (__int128)record.min * record.count ||
+        record.sum > (__int128)record.max * record.count) {
+      goto malformed;
     }
-    current_city.count += city.count;
-    current_city.sum += city.sum;
+    struct citydata city;
+    city.str.str = (char *)data + pos;
+    city.str.len = record.len;
+    city.min = record.min;
+    city.max = record.max;
+    city.sum = record.sum;
+    city.count = record.count;
+    merge_city(result, &city);
+    pos += record.len;
+  }
+  if (pos != size) {
+    goto malformed;
+  }
+  return;
+
+malformed:
+  fprintf(stderr, "%s: not partial results\n", name);
+  exit(EXIT_FAILURE);
+}
+
+// Merge a file of partial results into a table
+static void merge_partial(const char *filename, struct result *result) {
+  int fd = open(filename, O_RDONLY);
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) == -1) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+  unsigned long mapped_size;
+  char *mapped = map_padded(fd, 0, sb.st_size, &mapped_size);
+  if (mapped == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  merge_partial_data(filename, mapped, sb.st_size, result);
+  if (munmap(mapped, mapped_size) == -1) {
+    perror("munmap");
+    exit(EXIT_FAILURE);
   }
-  result->cities[hash] = current_city;
-  return true;
 }
 
-static inline void insert_name(struct result *result, struct citydata city) {
-  unsigned hash1 = HASH_SEED_1;
-  unsigned hash2 = HASH_SEED_2;
-  hashlittle2(city.str.str, city.str.len, &hash1, &hash2);
+// Format the sorted cities into a single buffer and write it out in one go. The buffer is sized for the worst case
+// of every format: names escaped to six times their length plus the punctuation and three temperatures.
+static void write_cities(const struct citydata *cities,
+                         unsigned long num_cities, int format) {
+  unsigned long size = 64;
+  for (unsigned long i = 0; i < num_cities; i++) {
+    size += 6 * (unsigned long)cities[i].str.len + 96;
+  }
+  char *buffer = malloc(size);
+  if (buffer == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  char *end;
+  switch (format) {
+  case FORMAT_CSV:
+    end = format_csv(buffer, cities, num_cities);
+    break;
+  case FORMAT_JSON:
+    end = format_json(buffer, cities, num_cities);
+    break;
+  case FORMAT_PARTIAL:
+    end = format_partial(buffer, cities, num_cities);
+    break;
+  default:
+    end = format_text(buffer, cities, num_cities);
+    break;
+  }
 
-  for (int i = 0; i < HASHTABLE_SIZE; i++) {
-    unsigned h1 = (hash1 + i) & (HASHTABLE_SIZE - 1);
-    unsigned h2 = (hash2 + i) & (HASHTABLE_SIZE - 1);
-    if (insert_name_hashed(result, city, h1) ||
-        insert_name_hashed(result, city, h2)) {
-      return;
+  for (char *pos = buffer; pos < end;) {
+    ssize_t written = write(STDOUT_FILENO, pos, end - pos);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      exit(EXIT_FAILURE);
     }
+    pos += written;
   }
+  free(buffer);
+}
 
-  fprintf(stderr, "hashtable full\n");
-  abort();
+// Seconds on the monotonic clock
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// ASSUMPTIONS: c is always present in str and str is allocated such that there are at least 16 bytes after the
-// appearence of c
-__attribute__((pure))
-static inline unsigned find_character(const char *str, char c) {
-  unsigned i = 0;
-  int mask = 0;
-  __m128i target = _mm_set1_epi8(c);
+// Run the rest of the program in a child process and return, in it, the end of a pipe to call fast_exit_done on.
+// The parent waits for that and exits right away: whoever started us sees the output end and our exit while the child
+// is still unmapping the file and freeing memory. If the child dies before, the parent exits with its status.
+static int fast_exit_setup(void) {
+  int fds[2];
+  if (pipe(fds) == -1) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  pid_t child = fork();
+  if (child == -1) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (child == 0) {
+    close(fds[0]);
+    return fds[1];
+  }
 
-  while (!mask) {
-    __m128i chunk = _mm_loadu_si128((__m128i *)(str + i));
-    __m128i res = _mm_cmpeq_epi8(chunk, target);
-    mask = _mm_movemask_epi8(res);
-    i += 16;
+  // Only the child writes the output, so it alone decides when readers see its end
+  close(fds[1]);
+  close(STDOUT_FILENO);
+  char done;
+  ssize_t got;
+  do {
+    got = read(fds[0], &done, 1);
+  } while (got == -1 && errno == EINTR);
+  if (got == 1) {
+    _exit(EXIT_SUCCESS);
+  }
+  int status;
+  if (waitpid(child, &status, 0) == -1) {
+    perror("waitpid");
+    _exit(EXIT_FAILURE);
+  }
+  _exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+}
+
+// Called by the child once the output is written: close it and let the parent go
+static void fast_exit_done(int notify) {
+  char done = 0;
+  close(STDOUT_FILENO);
+  if (write(notify, &done, 1) == -1) {
+    perror("write");
+    exit(EXIT_FAILURE);
   }
+  close(notify);
+}
 
-  return __builtin_ffs(mask) - 1 + i - 16;
+// Read a single number from a file, -1 if there isn't one
+static long read_number(const char *path) {
+  FILE *file = fopen(path, "r");
+  long number = -1;
+  if (file == NULL) {
+    return -1;
+  }
+  if (fscanf(file, "%ld", &number) != 1) {
+    number = -1;
+  }
+  fclose(file);
+  return number;
 }
 
-// Parse a single line
-static inline int parse_line(char *str, struct cityline *city) {
-  city->str.str = str;
+// How many CPUs worth of time the cgroup quota of this process allows, rounded up, or 0 if it has no quota. Looks
+// at cpu.max for cgroup v2 and cpu.cfs_quota_us for v1, in the group /proc/self/cgroup names for each hierarchy.
+static unsigned cgroup_cpu_limit(void) {
+  FILE *file = fopen("/proc/self/cgroup", "r");
+  if (file == NULL) {
+    return 0;
+  }
 
-  unsigned i;
+  char line[PATH_MAX];
+  char path[PATH_MAX + 64];
+  long quota = -1;
+  long period = 0;
+  while (quota < 0 && fgets(line, sizeof(line), file) != NULL) {
+    // Lines look like ID:CONTROLLERS:PATH, with no controllers for the v2 hierarchy
+    line[strcspn(line, "\n")] = '\0';
+    char *controllers = strchr(line, ':');
+    char *group = controllers != NULL ? strchr(controllers + 1, ':') : NULL;
+    if (group == NULL) {
+      continue;
+    }
+    *group++ = '\0';
+    controllers++;
 
-  i = find_character(str, ';');
-  city->str.len = i;
-  i++;
+    if (*controllers == '\0') {
+      // Either "max PERIOD" or "QUOTA PERIOD", where the former fails to scan as having no quota
+      snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", group);
+      FILE *max = fopen(path, "r");
+      if (max != NULL) {
+        if (fscanf(max, "%ld %ld", &quota, &period) != 2) {
+          quota = -1;
+        }
+        fclose(max);
+      }
+      continue;
+    }
+    for (char *name; (name = strsep(&controllers, ",")) != NULL;) {
+      if (strcmp(name, "cpu") == 0) {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_quota_us",
+                 group);
+        quota = read_number(path);
+        snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_period_us",
+                 group);
+        period = read_number(path);
+      }
+    }
+  }
+  fclose(file);
 
-  bool neg = str[i] == '-';
-  if (neg) {
-    i++;
+  if (quota <= 0 || period <= 0) {
+    return 0;
   }
+  return (quota + period - 1) / period;
+}
+
+// Core of a CPU, named by the first hardware thread in its sibling list, or the CPU itself if that can't be read
+static int cpu_core(int cpu) {
+  char path[128];
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  long first = read_number(path);
+  return first >= 0 && first < CPU_SETSIZE ? first : cpu;
+}
 
-  int n = 0;
-  for (;; i++) {
-    char c = str[i];
-    if (c == '.') {
+// NUMA node of a CPU, found as the nodeN entry of its sysfs directory. Machines without NUMA have everything on 0.
+static int cpu_node(int cpu) {
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  int node = 0;
+  if (dir == NULL) {
+    return 0;
+  }
+  for (struct dirent *entry; (entry = readdir(dir)) != NULL;) {
+    if (sscanf(entry->d_name, "node%d", &node) == 1) {
       break;
     }
-    n *= 10;
-    n += c - '0';
   }
-  i++;
+  closedir(dir);
+  return node;
+}
 
-  n *= 10;
-  n += str[i] - '0';
-  i++; // \n
-  i++;
+// List the CPUs this process may run on in cpus, leaving out every allowed hardware thread but the first of each
+// core if no_smt is set, and return how many there are
+static unsigned allowed_cpus(bool no_smt, int *cpus) {
+  cpu_set_t set;
+  cpu_set_t cores;
+  unsigned count = 0;
+  if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+    perror("sched_getaffinity");
+    exit(EXIT_FAILURE);
+  }
+  CPU_ZERO(&cores);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &set)) {
+      continue;
+    }
+    if (no_smt) {
+      int core = cpu_core(cpu);
+      if (CPU_ISSET(core, &cores)) {
+        continue;
+      }
+      CPU_SET(core, &cores);
+    }
+    cpus[count++] = cpu;
+  }
+  return count;
+}
 
-  if (neg) {
-    n = -n;
+// Threads to run when not told how many: one per CPU we may run on, or per core with no_smt, but no more than the
+// cgroup quota pays for and never none. The CPUs are listed in cpus, and how many there are and the quota are
+// stored for the caller.
+static unsigned default_threads(bool no_smt, int *cpus, unsigned *num_cpus,
+                                unsigned *cpu_limit) {
+  *num_cpus = allowed_cpus(no_smt, cpus);
+  *cpu_limit = cgroup_cpu_limit();
+  unsigned num_threads = *num_cpus;
+  if (*cpu_limit > 0 && *cpu_limit < num_threads) {
+    num_threads = *cpu_limit;
   }
-  city->measure = n;
+  return num_threads > 0 ? num_threads : 1;
+}
 
-  return i;
+// Whether a command line argument is the --processes option, whole or abbreviated, with its value or without
+__attribute__((pure))
+static bool is_processes_option(const char *arg) {
+  if (strncmp(arg, "--", 2) != 0) {
+    return false;
+  }
+  size_t len = strcspn(arg + 2, "=");
+  return len > 0 && strncmp(arg + 2, "processes", len) == 0 &&
+         len <= strlen("processes");
 }
 
-// Thread target that parses lines
-static void *parse_lines(void *arg) {
-  struct threadinfo *info = arg;
+// Split a file into byte ranges for num_processes copies of this program, which get every option we got except
+// --processes and send back their partial results through a socket each, and merge those into result. Workers
+// align their ranges to lines themselves. Unless threads_option says how many threads each one runs, they share
+// the threads this process would have run. If pin is set and there are enough CPUs, every worker is restricted to an
+// equal contiguous share of them, which keeps it on one NUMA node on machines that number CPUs node by node.
+static void run_processes(char *argv[], int first_file, const char *filename,
+                          unsigned num_processes, bool pin, bool no_smt,
+                          int threads_option, struct result *result) {
+  struct stat sb;
+  if (strcmp(filename, "-") == 0) {
+    fprintf(stderr, "--processes needs a regular file\n");
+    exit(EXIT_FAILURE);
+  }
+  if (stat(filename, &sb) == -1) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+  if (!S_ISREG(sb.st_mode)) {
+    fprintf(stderr, "--processes needs a regular file\n");
+    exit(EXIT_FAILURE);
+  }
+  int cpus[CPU_SETSIZE];
+  int cores[CPU_SETSIZE];
+  unsigned num_cpus = allowed_cpus(false, cpus);
+  unsigned num_cores;
+  unsigned cpu_limit;
+  unsigned worker_threads =
+      default_threads(no_smt, cores, &num_cores, &cpu_limit) / num_processes;
+  char threads[32];
+  snprintf(threads, sizeof(threads), "--threads=%u",
+           worker_threads > 0 ? worker_threads : 1);
 
-  char *start = info->start;
-  struct result result = info->result;
-  struct cityline current_city;
-
-  unsigned long i = 0;
-  while (i < info->size) {
-    int ii = parse_line(start + i, &current_city);
-    /* printf("%.*s;%d\n", current_city.str.len, current_city.str.str, */
-    /*        current_city.measure); */
-    struct citydata new_city;
-    new_city.count = 1;
-    new_city.max = current_city.measure;
-    new_city.min = current_city.measure;
-    new_city.sum = current_city.measure;
-    new_city.str = current_city.str;
-    insert_name(&result, new_city);
-    i += ii;
+  // Options, the thread count, the range and partial output, the end of options, the file and the NULL at the end
+  char **args = malloc(sizeof(*args) * (first_file + 6));
+  char range[64];
+  pid_t *workers = malloc(sizeof(*workers) * num_processes);
+  int *sockets = malloc(sizeof(*sockets) * num_processes);
+  if (args == NULL || workers == NULL || sockets == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
   }
-  info->result = result;
+  int num_args = 0;
+  args[num_args++] = argv[0];
+  for (int i = 1; i < first_file; i++) {
+    if (is_processes_option(argv[i])) {
+      i += strchr(argv[i], '=') == NULL;
+      continue;
+    }
+    // An end of options marker would make ours filenames, it is put back in front of the file
+    if (i == first_file - 1 && strcmp(argv[i], "--") == 0) {
+      continue;
+    }
+    args[num_args++] = argv[i];
+  }
+  // Ours come last so they win over the user's, --emit-partial over --format in particular
+  if (threads_option == 0) {
+    args[num_args++] = threads;
+  }
+  args[num_args++] = range;
+  args[num_args++] = "--emit-partial";
+  args[num_args++] = "--";
+  args[num_args++] = (char *)filename;
+  args[num_args] = NULL;
 
-  return NULL;
+  for (unsigned i = 0; i < num_processes; i++) {
+    unsigned long offset = sb.st_size * i / num_processes;
+    unsigned long end = sb.st_size * (i + 1UL) / num_processes;
+    snprintf(range, sizeof(range), "--range=%lu:%lu", offset, end - offset);
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+      perror("socketpair");
+      exit(EXIT_FAILURE);
+    }
+    workers[i] = fork();
+    if (workers[i] == -1) {
+      perror("fork");
+      exit(EXIT_FAILURE);
+    }
+    if (workers[i] == 0) {
+      if (pin && num_cpus >= num_processes) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned c = num_cpus * i / num_processes;
+             c < num_cpus * (i + 1) / num_processes; c++) {
+          CPU_SET(cpus[c], &set);
+        }
+        sched_setaffinity(0, sizeof(set), &set);
+      }
+      dup2(pair[1], STDOUT_FILENO);
+      close(pair[0]);
+      close(pair[1]);
+      execv("/proc/self/exe", args);
+      perror("execv");
+      _exit(EXIT_FAILURE);
+    }
+    close(pair[1]);
+    sockets[i] = pair[0];
+  }
+
+  // Each worker writes all of its results at the end, so waiting on them one after the other costs nothing
+  unsigned long capacity = 1 << 16;
+  char *buffer = malloc(capacity + INPUT_PADDING);
+  if (buffer == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (unsigned i = 0; i < num_processes; i++) {
+    unsigned long size = 0;
+    for (;;) {
+      if (size == capacity) {
+        capacity *= 2;
+        buffer = realloc(buffer, capacity + INPUT_PADDING);
+        if (buffer == NULL) {
+          perror("realloc");
+          exit(EXIT_FAILURE);
+        }
+      }
+      ssize_t got = read(sockets[i], buffer + size, capacity - size);
+      if (got == -1 && errno == EINTR) {
+        continue;
+      }
+      if (got == -1) {
+        perror("read");
+        exit(EXIT_FAILURE);
+      }
+      if (got == 0) {
+        break;
+      }
+      size += got;
+    }
+    close(sockets[i]);
+
+    int status;
+    if (waitpid(workers[i], &status, 0) == -1) {
+      perror("waitpid");
+      exit(EXIT_FAILURE);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Worker %u failed\n", i);
+      exit(EXIT_FAILURE);
+    }
+    memset(buffer + size, 0, INPUT_PADDING);
+    char name[32];
+    snprintf(name, sizeof(name), "worker %u", i);
+    merge_partial_data(name, buffer, size, result);
+  }
+
+  free(buffer);
+  free(sockets);
+  free(workers);
+  free(args);
 }
 
+// libanalyze.c includes this file for everything but the command line program
+#ifndef ANALYZE_LIBRARY
 int main(int argc, char *argv[]) {
   int fd;
   struct stat sb;
   char *mapped;
+  unsigned long mapped_size;
   char *filename;
+  const char *kernel_name = NULL;
+  bool verbose = false;
+  bool use_uring = false;
+  unsigned long max_rss = 0;
+  unsigned long prefetch = 0;
+  bool huge_pages = false;
+  int threads_option = 0;
+  bool pin = false;
+  bool no_smt = false;
+  bool shared_engine = false;
+  unsigned long shared_size = SHARED_TABLE_SIZE;
+  int streams = DEFAULT_STREAMS;
+  int format = FORMAT_TEXT;
+  bool fast_exit = false;
+  bool merge = false;
+  int processes = 0;
+  bool ranged = false;
+  unsigned long range_offset = 0;
+  unsigned long range_length = 0;
+  int notify = -1;
+  double teardown_start;
+  struct sharedtable shared;
+  int cpus[CPU_SETSIZE];
+  unsigned num_cpus;
+  unsigned cpu_limit;
+  pthread_attr_t attr;
+  pthread_t prefetcher;
+  struct uring ring;
+  const struct kernel *kernel;
   int num_threads;
-  unsigned long thread_workload;
+  struct workqueue work;
+  struct stream stream;
+  struct reduction reduction;
   struct threadinfo *threads;
-  struct citydata *all_cities;
+  struct citydata *cities;
+  unsigned long num_cities;
+
+  // Get options and filename from arguments
+  static const struct option long_options[] = {
+      {"kernel", required_argument, NULL, 'k'},
+      {"verbose", no_argument, NULL, 'v'},
+      {"io-uring", no_argument, NULL, 'u'},
+      {"max-rss", required_argument, NULL, 'm'},
+      {"prefetch", required_argument, NULL, 'p'},
+      {"huge-pages", no_argument, NULL, 'H'},
+      {"threads", required_argument, NULL, 't'},
+      {"pin", no_argument, NULL, 'P'},
+      {"no-smt", no_argument, NULL, 'S'},
+      {"engine", required_argument, NULL, 'e'},
+      {"table-size", required_argument, NULL, 'T'},
+      {"streams", required_argument, NULL, 's'},
+      {"format", required_argument, NULL, 'f'},
+      {"fast-exit", no_argument, NULL, 'x'},
+      {"emit-partial", no_argument, NULL, 'E'},
+      {"merge", no_argument, NULL, 'M'},
+      {"processes", required_argument, NULL, 'N'},
+      {"range", required_argument, NULL, 'R'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "k:vum:p:Ht:PSe:T:s:f:xEM", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'k':
+      kernel_name = optarg;
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'u':
+      use_uring = true;
+      break;
+    case 'm':
+      max_rss = parse_size(optarg);
+      if (max_rss == 0) {
+        goto usage;
+      }
+      break;
+    case 'H':
+      huge_pages = true;
+      break;
+    case 't':
+      threads_option = atoi(optarg);
+      if (threads_option <= 0) {
+        goto usage;
+      }
+      break;
+    case 'P':
+      pin = true;
+      break;
+    case 'S':
+      no_smt = true;
+      break;
+    case 'e':
+      if (strcmp(optarg, "shared") == 0) {
+        shared_engine = true;
+      } else if (strcmp(optarg, "private") != 0) {
+        goto usage;
+      }
+      break;
+    case 'x':
+      fast_exit = true;
+      break;
+    case 'E':
+      format = FORMAT_PARTIAL;
+      break;
+    case 'M':
+      merge = true;
+      break;
+    case 'N':
+      processes = atoi(optarg);
+      if (processes <= 0) {
+        goto usage;
+      }
+      break;
+    case 'R': {
+      char *end;
+      range_offset = strtoul(optarg, &end, 10);
+      if (*end != ':') {
+        goto usage;
+      }
+      range_length = strtoul(end + 1, &end, 10);
+      if (*end != '\0') {
+        goto usage;
+      }
+      ranged = true;
+      break;
+    }
+    case 'f':
+      if (strcmp(optarg, "text") == 0) {
+        format = FORMAT_TEXT;
+      } else if (strcmp(optarg, "csv") == 0) {
+        format = FORMAT_CSV;
+      } else if (strcmp(optarg, "json") == 0) {
+        format = FORMAT_JSON;
+      } else {
+        goto usage;
+      }
+      break;
+    case 's':
+      streams = atoi(optarg);
+      if (streams < 1 || streams > MAX_STREAMS) {
+        goto usage;
+      }
+      break;
+    case 'T':
+      shared_size = parse_size(optarg);
+      if (shared_size == 0) {
+        goto usage;
+      }
+      break;
+    case 'p':
+      prefetch = parse_size(optarg);
+      if (prefetch == 0) {
+        goto usage;
+      }
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if (merge ? optind >= argc : optind != argc - 1) {
+  usage:
+    fprintf(stderr,
+            "Usage: %s [--kernel=avx512|avx2|sse2|scalar] [--verbose] "
+            "[--io-uring] [--max-rss=SIZE[K|M|G]] "
+            "[--prefetch=DISTANCE[K|M|G]] [--huge-pages] [--threads=N] "
+            "[--pin] [--no-smt] [--engine=private|shared] "
+            "[--table-size=SLOTS] [--streams=1-4] [--format=text|csv|json] "
+            "[--fast-exit] [--emit-partial] [--processes=N] "
+            "[--range=OFFSET:LENGTH] <filename>|-\n"
+            "       %s --merge [--format=...|--emit-partial] <partial>...\n",
+            argv[0], argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  filename = argv[optind];
 
-  // Get filename from arguments
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <filename>\n", argv[0]);
+  // Before there are any threads, which fork doesn't carry over
+  if (fast_exit) {
+    notify = fast_exit_setup();
+  }
+
+  // Workers read their range of the file through a mapping, whole or in windows
+  if (processes > 0 && use_uring) {
+    fprintf(stderr, "--processes can't be combined with --io-uring\n");
     exit(EXIT_FAILURE);
   }
-  filename = argv[1];
 
-  // Open the file
-  fd = open(filename, O_RDONLY);
+  // Combine partial results from earlier runs, or from workers started here, instead of reading measurements
+  if (merge || processes > 0) {
+    struct result merged;
+    init_result(&merged, HASHTABLE_INITIAL_SIZE, false);
+    if (merge) {
+      for (int i = optind; i < argc; i++) {
+        merge_partial(argv[i], &merged);
+      }
+    } else {
+      run_processes(argv, optind, filename, processes, pin, no_smt,
+                    threads_option, &merged);
+    }
+    cities = malloc(sizeof(*cities) * (merged.size + 1));
+    num_cities = 0;
+    for (unsigned long i = 0; i <= merged.mask; i++) {
+      if (slot_used(&merged, i)) {
+        cities[num_cities++] = get_city(&merged, i);
+      }
+    }
+    sort_cities(cities, num_cities, 1);
+    write_cities(cities, num_cities, format);
+    if (fast_exit) {
+      fast_exit_done(notify);
+    }
+    free(cities);
+    free_result(&merged);
+    return 0;
+  }
+
+  kernel = select_kernel(kernel_name);
+  if (verbose) {
+    fprintf(stderr, "Using %s kernel\n", kernel->name);
+  }
+
+  // Open the file, - is standard input
+  if (strcmp(filename, "-") == 0) {
+    fd = STDIN_FILENO;
+  } else {
+    fd = open(filename, O_RDONLY);
+  }
   if (fd == -1) {
     perror("open");
     exit(EXIT_FAILURE);
@@ -228,98 +2666,268 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  // Map the file into memory, we map it 16 bytes larger to ensure SIMD instructions will not read out of bounds.
-  mapped = mmap(NULL, sb.st_size + 16, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (mapped == MAP_FAILED) {
-    perror("mmap");
-    exit(EXIT_FAILURE);
+  num_threads = default_threads(no_smt, cpus, &num_cpus, &cpu_limit);
+  if (threads_option > 0) {
+    num_threads = threads_option;
   }
-
-  // Provide a hint to the kernel about the expected access pattern
-  if (madvise(mapped, sb.st_size, MADV_SEQUENTIAL) == -1) {
-    perror("madvise");
-    exit(EXIT_FAILURE);
+  if (verbose) {
+    fprintf(stderr, "Using %d threads (%u CPUs available, quota of %u)\n",
+            num_threads, num_cpus, cpu_limit);
   }
 
   // Create thread information
-  num_threads = sysconf(_SC_NPROCESSORS_ONLN);
   threads = malloc(sizeof(*threads) * num_threads);
-  thread_workload = sb.st_size / num_threads;
+  work.nodes = malloc(sizeof(*work.nodes) * num_threads);
+  if (threads == NULL || work.nodes == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  work.index_block = kernel->index_block;
+  work.stream = NULL;
+  work.queues = NULL;
+  work.data = NULL;
+  work.fd = fd;
+  work.chunk_size = CHUNK_SIZE;
+  work.windowed = false;
+  work.base = 0;
+  work.file_size = sb.st_size;
+  work.prefetch_distance = 0;
+  work.huge_pages = huge_pages;
+  work.shared = NULL;
+  work.streams = streams;
+  mapped = NULL;
 
-  // Reserve memory used by all threads
-  all_cities = malloc(sizeof(*all_cities) * HASHTABLE_SIZE * num_threads);
-  for (int i = 0; i < num_threads * HASHTABLE_SIZE; i++) {
-    all_cities[i].count = 0;
+  // Pipes and such can't be mapped, they are read into buffers that go round between this thread and the
+  // parsing threads, with enough of them that every thread can have one while the next ones are being read
+  unsigned num_buffers = 2 * num_threads + 2;
+  if (use_uring && num_buffers < URING_MIN_BUFFERS) {
+    num_buffers = URING_MIN_BUFFERS;
   }
 
-  // Initialize threads
-  {
-    unsigned long total_workload = 0;
-    for (int i = 0; i < num_threads; i++) {
-      threads[i].start = mapped + total_workload;
-      unsigned workload = thread_workload;
-      if (i == num_threads - 1) {
-        workload = sb.st_size - total_workload;
-      } else {
-        while (threads[i].start[workload-1] != '\n') {
-          workload--;
-        }
+  // Files are read through io_uring only when asked to and the kernel lets us
+  use_uring = use_uring && S_ISREG(sb.st_mode);
+  if (use_uring && !init_uring(&ring, num_buffers)) {
+    if (verbose) {
+      fprintf(stderr, "io_uring unavailable (%s), mapping the file instead\n",
+              strerror(errno));
+    }
+    use_uring = false;
+  }
+
+  if (!S_ISREG(sb.st_mode) || use_uring) {
+    init_stream(&stream, fd, num_buffers);
+    work.stream = &stream;
+
+    if (use_uring) {
+      // Bypass the page cache if the file system allows it
+      int direct_fd = open(filename, O_RDONLY | O_DIRECT);
+      if (direct_fd != -1) {
+        stream.fd = direct_fd;
+      } else if (verbose) {
+        fprintf(stderr, "O_DIRECT unavailable (%s), reading through the page cache\n",
+                strerror(errno));
+      }
+      register_buffers(&ring, &stream);
+      if (verbose) {
+        fprintf(stderr, "Reading through io_uring with %u buffers%s\n",
+                num_buffers, ring.fixed_buffers ? ", registered" : "");
       }
-      threads[i].size = workload;
-      total_workload += workload;
-      threads[i].result.cities = all_cities + i * HASHTABLE_SIZE;
     }
+  } else if (max_rss > 0) {
+    // Every thread maps one chunk at a time, plus a little on either side of it, so the chunks are sized for
+    // threads times that to fit in the limit
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long overhead = STREAM_HEADROOM + INPUT_PADDING + 2 * page_size;
+    unsigned long per_thread = max_rss / num_threads;
+    work.windowed = true;
+    work.chunk_size = MIN_WINDOW_SIZE;
+    if (per_thread > overhead + MIN_WINDOW_SIZE) {
+      work.chunk_size = (per_thread - overhead) & ~(page_size - 1);
+    }
+    if (verbose) {
+      fprintf(stderr, "Mapping the file in windows of %lu bytes per thread\n",
+              work.chunk_size);
+    }
+  } else {
+    // Map the file into memory, padded to ensure SIMD instructions will not read out of bounds.
+    mapped = map_padded(fd, 0, sb.st_size, &mapped_size);
+    if (mapped == MAP_FAILED) {
+      perror("mmap");
+      exit(EXIT_FAILURE);
+    }
+
+    // Provide a hint to the kernel about the expected access pattern
+    if (madvise(mapped, sb.st_size, MADV_SEQUENTIAL) == -1) {
+      perror("madvise");
+      exit(EXIT_FAILURE);
+    }
+    // Only some filesystems can put files in huge pages, the rest turn the advice down and keep small ones
+    if (huge_pages && madvise(mapped, sb.st_size, MADV_HUGEPAGE) == -1 &&
+        verbose) {
+      fprintf(stderr, "No huge pages for the input mapping: %s\n",
+              strerror(errno));
+    }
+    work.data = mapped;
+  }
+
+  if (ranged && work.stream != NULL) {
+    fprintf(stderr, "--range needs a regular file, without --io-uring\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (work.stream == NULL) {
+    work.size = sb.st_size;
+    // Only the lines that start in the range, found the same way as the ends of chunks. Windows find them
+    // themselves, they only need to know where the range is.
+    if (ranged && work.windowed) {
+      unsigned long end = range_offset + range_length;
+      work.base = range_offset < work.size ? range_offset : work.size;
+      work.size = (end < work.size ? end : work.size) - work.base;
+    } else if (ranged) {
+      unsigned long end = range_offset + range_length;
+      unsigned long start = line_boundary(work.data, work.size, range_offset);
+      end = line_boundary(work.data, work.size, end < work.size ? end : work.size);
+      work.data += start;
+      work.size = end > start ? end - start : 0;
+    }
+    init_queues(&work, num_threads);
+    // The distance is rounded up to whole chunks
+    work.prefetch_distance = (prefetch + work.chunk_size - 1) / work.chunk_size;
+  }
+
+  // A single table for everyone instead of one per thread, sized up front to a power of two as it can't grow
+  if (shared_engine) {
+    unsigned long slots = 1;
+    while (slots < shared_size) {
+      slots *= 2;
+    }
+    shared.slots = aligned_alloc(64, slots * sizeof(*shared.slots));
+    if (shared.slots == NULL) {
+      perror("aligned_alloc");
+      exit(EXIT_FAILURE);
+    }
+    memset(shared.slots, 0, slots * sizeof(*shared.slots));
+    shared.mask = slots - 1;
+    work.shared = &shared;
+    if (verbose) {
+      fprintf(stderr, "Using a shared table of %lu slots\n", slots);
+    }
+  }
+
+  // Initialize threads
+  // Pinned threads go round the allowed CPUs in order, so they fill one core after the other
+  for (int i = 0; i < num_threads; i++) {
+    threads[i].id = i;
+    threads[i].work = &work;
+    threads[i].reduction = &reduction;
+    threads[i].cpu = pin ? cpus[i % num_cpus] : -1;
+    memset(&threads[i].result, 0, sizeof(threads[i].result));
+    work.nodes[i] = pin ? cpu_node(threads[i].cpu) : 0;
   }
 
-  // Launch threads, join them
+  reduction.num_threads = num_threads;
+  reduction.threads = threads;
+  pthread_barrier_init(&reduction.barrier, NULL, num_threads);
+
+  // Launch threads, join them. Their tables are merged into the first one by the time they are done.
   for (int i = 0; i < num_threads; i++) {
-    pthread_create(&threads[i].thread, NULL, parse_lines, (void *)&threads[i]);
+    pthread_attr_init(&attr);
+    if (threads[i].cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(threads[i].cpu, &set);
+      pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    pthread_create(&threads[i].thread, &attr, parse_lines, (void *)&threads[i]);
+    pthread_attr_destroy(&attr);
+  }
+  if (work.prefetch_distance > 0) {
+    pthread_create(&prefetcher, NULL, prefetch_ahead, (void *)&work);
+  }
+  if (use_uring) {
+    read_stream_uring(work.stream, &ring, sb.st_size);
+  } else if (work.stream != NULL) {
+    int error = read_stream(work.stream);
+    if (error != 0) {
+      report_stream_error(error);
+      exit(EXIT_FAILURE);
+    }
   }
   for (int i = 0; i < num_threads; i++) {
     pthread_join(threads[i].thread, NULL);
   }
+  if (work.prefetch_distance > 0) {
+    pthread_join(prefetcher, NULL);
+  }
 
-  // Or run them sequentially for testing
-  /* for (int i = 0; i < num_threads; i++) { */
-  /*   parse_lines(&threads[i]); */
-  /* } */
+  pthread_barrier_destroy(&reduction.barrier);
 
-  // Merge all hash tables into the first
-  for (int i = 1; i < num_threads; i++) {
-    for (int j = 0; j < HASHTABLE_SIZE; j++) {
-      struct citydata city = threads[i].result.cities[j];
-      if (city.count > 0) {
-        insert_name(&threads[0].result, city);
+  // Compact the occupied slots of the first hash table, or the shared one, into a list and sort it
+  num_cities = 0;
+  if (work.shared != NULL) {
+    cities = malloc(sizeof(*cities) * (shared.mask + 1));
+    for (unsigned long i = 0; i <= shared.mask; i++) {
+      struct sharedslot *slot = &shared.slots[i];
+      if (slot->state == SLOT_READY) {
+        struct citydata *city = &cities[num_cities++];
+        city->str.str = slot->str;
+        city->str.len = slot->len;
+        city->max = slot->max;
+        city->min = slot->min;
+        city->sum = slot->sum;
+        city->count = slot->count;
+      }
+    }
+  } else {
+    cities = malloc(sizeof(*cities) * (threads[0].result.size + 1));
+    for (unsigned long i = 0; i <= threads[0].result.mask; i++) {
+      if (slot_used(&threads[0].result, i)) {
+        cities[num_cities++] = get_city(&threads[0].result, i);
       }
     }
   }
+  sort_cities(cities, num_cities, num_threads);
 
-  // Treat the first hash table as a list and sort it
-  qsort(threads[0].result.cities, HASHTABLE_SIZE, sizeof(*all_cities),
-        stringslice_cmp);
-
-  // Output the results -- Not the exact correct output format but I'm not dealing with that
-  for (int i = 0; i < HASHTABLE_SIZE; i++) {
-    struct citydata city = threads[0].result.cities[i];
-    if (city.count > 0) {
-      printf("%.*s=%.1f/%.1f/%.1f\n", city.str.len, city.str.str,
-             (double)city.max / 10.0, (double)city.min / 10.0,
-             (double)city.sum / (double)city.count / 10.0);
-    }
+  // Output the results
+  write_cities(cities, num_cities, format);
+  if (fast_exit) {
+    fast_exit_done(notify);
   }
+  teardown_start = now();
 
   // Unmap the file
-  if (munmap(mapped, sb.st_size) == -1) {
+  if (mapped != NULL && munmap(mapped, mapped_size) == -1) {
     perror("munmap");
     exit(EXIT_FAILURE);
   }
 
   // Close the file descriptor
   close(fd);
+  if (use_uring) {
+    if (stream.fd != fd) {
+      close(stream.fd);
+    }
+    free_uring(&ring);
+  }
 
   // Free memory
+  for (int i = 0; i < num_threads; i++) {
+    free_result(&threads[i].result);
+  }
   free(threads);
-  free(all_cities);
+  free(work.nodes);
+  if (work.shared != NULL) {
+    free(shared.slots);
+  }
+  free(work.queues);
+  free(cities);
+  if (work.stream != NULL) {
+    free_stream(work.stream);
+  }
 
+  if (verbose) {
+    fprintf(stderr, "Teardown took %.3f seconds\n", now() - teardown_start);
+  }
   return 0;
 }
+#endif
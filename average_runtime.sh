@@ -6,15 +6,35 @@ if [ $# -eq 0 ]; then
 fi
 
 command="$@"
+input="${@: -1}"
+cold_runs=3
 total_runs=8
 discard_runs=3
 measure_runs=$((total_runs - discard_runs))
-total_time=0
 
+run_once() {
+    ( { /usr/bin/time -f "%e" $command 1>/dev/null; } 2>&1 )
+}
+
+# Cold runs: the input is dropped from the page cache before each one so it has to come from disk. The warm runs
+# below discard their first few and would never show this case.
+if [ -f "$input" ]; then
+    total_time=0
+    for i in $(seq 1 $cold_runs); do
+        dd if="$input" iflag=nocache count=0 status=none
+        real_time=$(run_once)
+        echo "cold: $real_time"
+        total_time=$(echo "$total_time + $real_time" | bc)
+    done
+    average_time=$(echo "scale=3; $total_time / $cold_runs" | bc)
+    echo "Average cold runtime: $average_time seconds"
+fi
+
+total_time=0
 for i in $(seq 1 $total_runs); do
-    real_time=$( ( { /usr/bin/time -f "%e" $command 1>/dev/null; } 2>&1 ) )
+    real_time=$(run_once)
     if [ $i -gt $discard_runs ]; then
-        echo "$real_time"
+        echo "warm: $real_time"
         total_time=$(echo "$total_time + $real_time" | bc)
     else
         echo "discard..."
@@ -22,4 +42,4 @@ for i in $(seq 1 $total_runs); do
 done
 
 average_time=$(echo "scale=3; $total_time / $measure_runs" | bc)
-echo "Average runtime: $average_time seconds"
+echo "Average warm runtime: $average_time seconds"
@@ -0,0 +1,277 @@
+// The library is the program's engine with a different front: analyze.c is included whole, minus its main, and
+// the functions below drive the same stages (partitioning, parse_lines with its reduction, sorting) for callers.
+#define ANALYZE_LIBRARY
+#include "analyze.c"
+#include "libanalyze.h"
+#include <stddef.h>
+
+// Threads that wait between calls, each keeping its hash table. A call fills in work, bumps started and waits for
+// finished to go up by one per thread.
+struct analyze_pool {
+  unsigned num_threads;
+  struct threadinfo *threads;
+  struct workqueue work;
+  struct reduction reduction;
+  bool stopping;
+  _Atomic unsigned started;
+  _Atomic unsigned finished;
+};
+
+struct analyze_results {
+  size_t count;
+  struct analyze_city *cities;
+  char *names;
+};
+
+// Thread target of a pool: run parse_lines for every call until the pool is destroyed
+static void *pool_worker(void *arg) {
+  struct threadinfo *info = arg;
+  struct analyze_pool *pool =
+      (struct analyze_pool *)((char *)info->work -
+                              offsetof(struct analyze_pool, work));
+  unsigned seen = 0;
+  for (;;) {
+    unsigned started;
+    while ((started = atomic_load_explicit(&pool->started,
+                                           memory_order_acquire)) == seen) {
+      wait_for_change(&pool->started, seen);
+    }
+    seen = started;
+    if (pool->stopping) {
+      return NULL;
+    }
+    parse_lines(info);
+    wake_waiters(&pool->finished);
+  }
+}
+
+analyze_pool *analyze_pool_create(unsigned num_threads) {
+  struct analyze_pool *pool = calloc(1, sizeof(*pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  if (num_threads == 0) {
+    int cpus[CPU_SETSIZE];
+    unsigned num_cpus;
+    unsigned cpu_limit;
+    num_threads = default_threads(false, cpus, &num_cpus, &cpu_limit);
+  }
+  pool->num_threads = num_threads;
+  pool->threads = calloc(num_threads, sizeof(*pool->threads));
+  pool->work.nodes = calloc(num_threads, sizeof(*pool->work.nodes));
+  if (pool->threads == NULL || pool->work.nodes == NULL) {
+    free(pool->threads);
+    free(pool->work.nodes);
+    free(pool);
+    return NULL;
+  }
+
+  pool->work.index_block = select_kernel(NULL)->index_block;
+  pool->work.fd = -1;
+  pool->work.chunk_size = CHUNK_SIZE;
+  pool->work.streams = DEFAULT_STREAMS;
+  pool->reduction.num_threads = num_threads;
+  pool->reduction.threads = pool->threads;
+  pthread_barrier_init(&pool->reduction.barrier, NULL, num_threads);
+  atomic_init(&pool->started, 0);
+  atomic_init(&pool->finished, 0);
+
+  for (unsigned i = 0; i < num_threads; i++) {
+    pool->threads[i].id = i;
+    pool->threads[i].cpu = -1;
+    pool->threads[i].work = &pool->work;
+    pool->threads[i].reduction = &pool->reduction;
+    int error = pthread_create(&pool->threads[i].thread, NULL, pool_worker,
+                               &pool->threads[i]);
+    if (error != 0) {
+      // Only the threads that did start are stopped
+      pool->num_threads = i;
+      analyze_pool_destroy(pool);
+      errno = error;
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+void analyze_pool_destroy(analyze_pool *pool) {
+  pool->stopping = true;
+  wake_waiters(&pool->started);
+  for (unsigned i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i].thread, NULL);
+    free_result(&pool->threads[i].result);
+  }
+  pthread_barrier_destroy(&pool->reduction.barrier);
+  free(pool->threads);
+  free(pool->work.nodes);
+  free(pool);
+}
+
+// Run the threads of a pool on its work, reading the stream from this thread if there is one, and wait for them.
+// Returns what read_stream does, 0 without a stream.
+static int run_pool(struct analyze_pool *pool) {
+  int error = 0;
+  unsigned finished = atomic_load_explicit(&pool->finished, memory_order_acquire);
+  wake_waiters(&pool->started);
+  if (pool->work.stream != NULL) {
+    error = read_stream(pool->work.stream);
+  }
+  unsigned now;
+  while ((now = atomic_load_explicit(&pool->finished, memory_order_acquire)) -
+             finished < pool->num_threads) {
+    wait_for_change(&pool->finished, now);
+  }
+  return error;
+}
+
+// Sort what the first table ended up with into results that own their names, and empty the table for the next call
+static analyze_results *collect_results(struct analyze_pool *pool) {
+  struct result *table = &pool->threads[0].result;
+  struct analyze_results *results = malloc(sizeof(*results));
+  struct citydata *cities = malloc(sizeof(*cities) * (table->size + 1));
+  if (results == NULL || cities == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t count = 0;
+  size_t names_size = 0;
+  for (unsigned long i = 0; i <= table->mask; i++) {
+    if (slot_used(table, i)) {
+      cities[count] = get_city(table, i);
+      names_size += cities[count].str.len + 1;
+      count++;
+    }
+  }
+  sort_cities(cities, count, pool->num_threads);
+
+  results->count = count;
+  results->cities = malloc(sizeof(*results->cities) * (count + 1));
+  results->names = malloc(names_size + 1);
+  if (results->cities == NULL || results->names == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  char *name = results->names;
+  for (size_t i = 0; i < count; i++) {
+    struct analyze_city *city = &results->cities[i];
+    memcpy(name, cities[i].str.str, cities[i].str.len);
+    name[cities[i].str.len] = '\0';
+    city->name = name;
+    city->name_len = cities[i].str.len;
+    city->min = cities[i].min;
+    city->max = cities[i].max;
+    city->sum = cities[i].sum;
+    city->count = cities[i].count;
+    name += cities[i].str.len + 1;
+  }
+
+  free(cities);
+  clear_result(table);
+  return results;
+}
+
+int analyze_buffer(analyze_pool *pool, const char *data, size_t size,
+                   analyze_results **results) {
+  // The parser reads up to INPUT_PADDING bytes past the lines it is given. Lines that end closer than that to the
+  // end of the buffer are copied out with padding after them, everything before them is parsed in place.
+  size_t body = 0;
+  if (size > INPUT_PADDING) {
+    const char *newline = memrchr(data, '\n', size - INPUT_PADDING);
+    body = newline != NULL ? (size_t)(newline + 1 - data) : 0;
+  }
+  size_t tail_size = size - body;
+  char *tail = calloc(1, tail_size + INPUT_PADDING);
+  if (tail == NULL) {
+    return -1;
+  }
+  memcpy(tail, data + body, tail_size);
+
+  pool->work.stream = NULL;
+  pool->work.data = (char *)data;
+  pool->work.size = body;
+  init_queues(&pool->work, pool->num_threads);
+  run_pool(pool);
+  free(pool->work.queues);
+  pool->work.queues = NULL;
+
+  parse_chunk(&pool->work, tail, tail_size, &pool->threads[0].result);
+  free(tail);
+
+  *results = collect_results(pool);
+  return 0;
+}
+
+int analyze_fd(analyze_pool *pool, int fd, analyze_results **results) {
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    return -1;
+  }
+
+  if (!S_ISREG(sb.st_mode)) {
+    struct stream stream;
+    init_stream(&stream, fd, 2 * pool->num_threads + 2);
+    pool->work.stream = &stream;
+    int error = run_pool(pool);
+    pool->work.stream = NULL;
+    free_stream(&stream);
+    if (error != 0) {
+      // What was parsed before the error is thrown away, the pool starts the next call empty
+      for (unsigned i = 0; i < pool->num_threads; i++) {
+        clear_result(&pool->threads[i].result);
+      }
+      errno = error == -1 ? EINVAL : error;
+      return -1;
+    }
+    *results = collect_results(pool);
+    return 0;
+  }
+
+  // Like the stream, a file is read from the current position to its end, which is where the position is left
+  off_t position = lseek(fd, 0, SEEK_CUR);
+  if (position == -1) {
+    return -1;
+  }
+  unsigned long start = position < sb.st_size ? position : sb.st_size;
+  unsigned long page_start = start & ~(sysconf(_SC_PAGESIZE) - 1);
+  unsigned long mapped_size;
+  char *mapped =
+      map_padded(fd, page_start, sb.st_size - page_start, &mapped_size);
+  if (mapped == MAP_FAILED) {
+    return -1;
+  }
+  madvise(mapped, sb.st_size - page_start, MADV_SEQUENTIAL);
+  pool->work.stream = NULL;
+  pool->work.data = mapped + (start - page_start);
+  pool->work.size = sb.st_size - start;
+  init_queues(&pool->work, pool->num_threads);
+  run_pool(pool);
+  free(pool->work.queues);
+  pool->work.queues = NULL;
+  munmap(mapped, mapped_size);
+  lseek(fd, 0, SEEK_END);
+
+  *results = collect_results(pool);
+  return 0;
+}
+
+const struct analyze_city *analyze_results_cities(const analyze_results *results,
+                                                  size_t *count) {
+  *count = results->count;
+  return results->cities;
+}
+
+void analyze_results_free(analyze_results *results) {
+  free(results->cities);
+  free(results->names);
+  free(results);
+}
+
+__attribute__((pure))
+long analyze_city_mean(const struct analyze_city *city) {
+  struct citydata data;
+  data.sum = city->sum;
+  data.count = city->count;
+  return mean_tenths(&data);
+}
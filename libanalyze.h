@@ -0,0 +1,62 @@
+#ifndef LIBANALYZE_H
+#define LIBANALYZE_H
+
+#include <stddef.h>
+
+// Aggregate lines of the form name;temperature, with temperatures between -99.9 and 99.9 with one decimal, into the
+// minimum, mean and maximum temperature of every name. This is the same engine as the analyze program, for callers
+// that want it without a process and text output in between.
+//
+// A pool keeps its threads and their hash tables from one call to the next. Calls on the same pool must not overlap,
+// calls on different pools may. Running out of memory ends the process, as it does for the program.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Statistics of a name. Temperatures are in tenths of a degree.
+struct analyze_city {
+  const char *name; // followed by a NUL
+  size_t name_len;
+  int min;
+  int max;
+  long sum;
+  unsigned long count;
+};
+
+typedef struct analyze_pool analyze_pool;
+typedef struct analyze_results analyze_results;
+
+// Start a pool of num_threads threads, or of as many as the affinity mask and cgroup CPU quota allow if it is 0.
+// Returns NULL and sets errno on failure.
+analyze_pool *analyze_pool_create(unsigned num_threads);
+
+// Stop the threads of a pool and free it
+void analyze_pool_destroy(analyze_pool *pool);
+
+// Aggregate the lines in size bytes at data, which needn't be padded or end with a newline. On success returns 0
+// and stores the results in *results; on failure returns -1 and sets errno.
+int analyze_buffer(analyze_pool *pool, const char *data, size_t size,
+                   analyze_results **results);
+
+// Aggregate everything that can be read from fd from its current position on, which is mapped if it is a regular
+// file and read to its end otherwise. The descriptor is left open, positioned at the end of what was read. Returns
+// like analyze_buffer; errno is EINVAL if a line is longer than 4096 bytes in input that isn't a regular file, or
+// that of the read that failed. Nothing of a failed call is kept in the pool.
+int analyze_fd(analyze_pool *pool, int fd, analyze_results **results);
+
+// The cities of some results ordered by name as unsigned bytes, and how many there are. They live as long as the
+// results do.
+const struct analyze_city *analyze_results_cities(const analyze_results *results,
+                                                  size_t *count);
+
+void analyze_results_free(analyze_results *results);
+
+// Mean temperature of a city in tenths of a degree, rounded half up
+long analyze_city_mean(const struct analyze_city *city);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+// Check libanalyze against the program: every way of feeding the library some input has to give the output the
+// program gave for it, on a single pool that is reused from call to call, also after a call that failed.
+//
+// Usage: libanalyze_check <input> <expected output>
+#define _GNU_SOURCE
+#include "libanalyze.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Read a whole file into memory, exiting if it can't be
+static char *read_file(const char *filename, size_t *size) {
+  int fd = open(filename, O_RDONLY);
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) == -1) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+  char *data = malloc(sb.st_size + 1);
+  if (data == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  size_t done = 0;
+  while (done < (size_t)sb.st_size) {
+    ssize_t n = read(fd, data + done, sb.st_size - done);
+    if (n <= 0) {
+      perror(filename);
+      exit(EXIT_FAILURE);
+    }
+    done += n;
+  }
+  close(fd);
+  *size = done;
+  return data;
+}
+
+static void print_tenths(FILE *out, long tenths) {
+  fprintf(out, "%s%ld.%ld", tenths < 0 ? "-" : "", labs(tenths) / 10,
+          labs(tenths) % 10);
+}
+
+// Format results the way the program does by default
+static char *format_results(analyze_results *results) {
+  char *text;
+  size_t size;
+  FILE *out = open_memstream(&text, &size);
+  size_t count;
+  const struct analyze_city *cities = analyze_results_cities(results, &count);
+  fputc('{', out);
+  for (size_t i = 0; i < count; i++) {
+    fprintf(out, "%s%s=", i > 0 ? ", " : "", cities[i].name);
+    print_tenths(out, cities[i].min);
+    fputc('/', out);
+    print_tenths(out, analyze_city_mean(&cities[i]));
+    fputc('/', out);
+    print_tenths(out, cities[i].max);
+  }
+  fputs("}\n", out);
+  fclose(out);
+  analyze_results_free(results);
+  return text;
+}
+
+// Start a child that writes size bytes of data to a pipe and return the end to read them from
+static int pipe_from(const char *data, size_t size, pid_t *child) {
+  int fds[2];
+  if (pipe(fds) == -1 || (*child = fork()) == -1) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  if (*child == 0) {
+    close(fds[0]);
+    while (size > 0) {
+      ssize_t n = write(fds[1], data, size);
+      if (n <= 0) {
+        _exit(EXIT_FAILURE);
+      }
+      data += n;
+      size -= n;
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  close(fds[1]);
+  return fds[0];
+}
+
+static bool check(const char *what, analyze_results *results,
+                  const char *expected) {
+  char *text = format_results(results);
+  bool same = strcmp(text, expected) == 0;
+  if (!same) {
+    fprintf(stderr, "%s: output differs from the program's\n", what);
+  }
+  free(text);
+  return same;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <input> <expected output>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  size_t size;
+  size_t expected_size;
+  char *data = read_file(argv[1], &size);
+  char *expected = read_file(argv[2], &expected_size);
+  expected[expected_size] = '\0';
+
+  analyze_pool *pool = analyze_pool_create(2);
+  if (pool == NULL) {
+    perror("analyze_pool_create");
+    return EXIT_FAILURE;
+  }
+  bool ok = true;
+  analyze_results *results;
+
+  // Twice each, so the second call shows nothing was left over from the first
+  for (int round = 0; round < 2; round++) {
+    if (analyze_buffer(pool, data, size, &results) == -1) {
+      perror("analyze_buffer");
+      return EXIT_FAILURE;
+    }
+    ok &= check("analyze_buffer", results, expected);
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1 || analyze_fd(pool, fd, &results) == -1) {
+      perror("analyze_fd");
+      return EXIT_FAILURE;
+    }
+    close(fd);
+    ok &= check("analyze_fd on a file", results, expected);
+
+    pid_t child;
+    fd = pipe_from(data, size, &child);
+    if (analyze_fd(pool, fd, &results) == -1) {
+      perror("analyze_fd");
+      return EXIT_FAILURE;
+    }
+    close(fd);
+    waitpid(child, NULL, 0);
+    ok &= check("analyze_fd on a pipe", results, expected);
+  }
+
+  // A line too long for the stream buffers is an error for the call, not the end of the process
+  size_t long_size = 4 << 20;
+  char *long_line = malloc(long_size);
+  if (long_line == NULL) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+  memset(long_line, 'x', long_size);
+  pid_t child;
+  int fd = pipe_from(long_line, long_size, &child);
+  if (analyze_fd(pool, fd, &results) != -1 || errno != EINVAL) {
+    fprintf(stderr, "analyze_fd on a line too long: no EINVAL\n");
+    ok = false;
+  }
+  close(fd);
+  waitpid(child, NULL, 0);
+  free(long_line);
+
+  if (analyze_buffer(pool, data, size, &results) == -1) {
+    perror("analyze_buffer");
+    return EXIT_FAILURE;
+  }
+  ok &= check("analyze_buffer after an error", results, expected);
+
+  analyze_pool_destroy(pool);
+  free(data);
+  free(expected);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}